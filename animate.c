@@ -0,0 +1,367 @@
+#define _GNU_SOURCE
+
+/* *** Includes ******************************************************/
+#include <stdbool.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+#include "queercat_internal.h"
+#include "animate.h"
+
+
+/* *** Constants *****************************************************/
+#define PERIODS_PER_SECOND (0.5)
+#define UNKNOWN_SIZE (UINT32_MAX)
+#define HIDE_CURSOR "\033[?25l"
+#define SHOW_CURSOR "\033[?25h"
+#define CLEAR_SCREEN "\033[H\033[2J"
+#define MAX_CURSOR_MOVE_LENGTH (32)
+#define MAX_BRIDGE_CELLS (4)         /* Unchanged cells rewritten rather than moved over. */
+
+
+/* *** Types *********************************************************/
+/* Cell of the layout on screen, and the color it shows. */
+typedef struct screen_cell_s {
+    const layout_cell_t *cell;
+    uint32_t row;
+    uint32_t column;
+    uint32_t key;
+} screen_cell_t;
+
+/* What the terminal is at between two writes. */
+typedef struct terminal_s {
+    uint32_t row;
+    uint32_t column;              /* UNKNOWN_SIZE after writing in the last column. */
+    bool color_valid;
+    uint32_t color_key;
+} terminal_t;
+
+
+/* *** Functions Declarations ****************************************/
+static void handle_stop(int signal_number);
+static void handle_resize(int signal_number);
+static void read_window_size(uint32_t *rows, uint32_t *columns);
+static bool same_color(const colorizer_t *colorizer, uint32_t key1, uint32_t key2);
+static void move_cursor(output_buffer_t *frame, terminal_t *terminal, uint32_t row, uint32_t column);
+static void draw_cell(output_buffer_t *frame, terminal_t *terminal, const colorizer_t *colorizer, const uint8_t *text,
+                      screen_cell_t *screen_cell, uint32_t key, const escape_code_t *escape_code, uint32_t columns);
+static bool bridges_to_change(const colorizer_t *colorizer, const terminal_t *terminal, const screen_cell_t *screen_cells,
+                              size_t count, size_t index, uint32_t offset);
+static size_t place_cells(const layout_t *layout, uint64_t lines, uint32_t rows, uint32_t columns, screen_cell_t *screen_cells,
+                          uint32_t *home_row);
+static void draw_text(output_buffer_t *frame, terminal_t *terminal, const colorizer_t *colorizer, const layout_t *layout,
+                      screen_cell_t *screen_cells, size_t screen_cells_count, uint32_t offset, uint32_t home_row);
+
+
+/* *** Globals *******************************************************/
+static volatile sig_atomic_t stop_signal;
+static volatile sig_atomic_t window_resized;
+
+
+/* *** Functions *****************************************************/
+static void handle_stop(int signal_number)
+{
+    stop_signal = signal_number;
+}
+
+static void handle_resize(int signal_number)
+{
+    UNUSED(signal_number);
+    window_resized = 1;
+}
+
+static void read_window_size(uint32_t *rows, uint32_t *columns)
+{
+    struct winsize size = { 0 };
+
+    *rows = UNKNOWN_SIZE;
+    *columns = UNKNOWN_SIZE;
+    if (!ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) && size.ws_col && size.ws_row) {
+        *columns = size.ws_col;
+        *rows = size.ws_row;
+    }
+}
+
+static bool same_color(const colorizer_t *colorizer, uint32_t key1, uint32_t key2)
+{
+    color_t color1 = { key1 >> 16, (key1 >> 8) & 0xff, key1 & 0xff };
+    color_t color2 = { key2 >> 16, (key2 >> 8) & 0xff, key2 & 0xff };
+
+    /* With a threshold, 24-bit colors too close to tell apart are not redrawn. */
+    if (colorizer->color_type != COLOR_TYPE_24_BIT || colorizer->threshold_squared <= 0)
+        return key1 == key2;
+    return color_distance_squared(&color1, &color2) <= colorizer->threshold_squared;
+}
+
+static void move_cursor(output_buffer_t *frame, terminal_t *terminal, uint32_t row, uint32_t column)
+{
+    output_reserve(frame, 2 * MAX_CURSOR_MOVE_LENGTH);
+
+    /* Relative moves only, the text may have scrolled the screen. */
+    if (row < terminal->row)
+        frame->length += sprintf(frame->data + frame->length, "\033[%" PRIu32 "A", terminal->row - row);
+    else if (row > terminal->row)
+        frame->length += sprintf(frame->data + frame->length, "\033[%" PRIu32 "B", row - terminal->row);
+
+    if (column == 0 && terminal->column != 0)
+        frame->data[frame->length++] = '\r';
+    else if (column != terminal->column)
+        frame->length += sprintf(frame->data + frame->length, "\033[%" PRIu32 "G", column + 1);
+
+    terminal->row = row;
+    terminal->column = column;
+}
+
+static void draw_cell(output_buffer_t *frame, terminal_t *terminal, const colorizer_t *colorizer, const uint8_t *text,
+                      screen_cell_t *screen_cell, uint32_t key, const escape_code_t *escape_code, uint32_t columns)
+{
+    const layout_cell_t *cell = screen_cell->cell;
+
+    move_cursor(frame, terminal, screen_cell->row, screen_cell->column);
+    if (!terminal->color_valid || !same_color(colorizer, terminal->color_key, key)) {
+        output_append(frame, escape_code->bytes, escape_code->length);
+        terminal->color_valid = true;
+        terminal->color_key = key;
+    }
+    output_append(frame, text + cell->offset, cell->length);
+    screen_cell->key = terminal->color_key;
+
+    /* Past the last column the cursor waits to wrap, where it is depends on the terminal. */
+    terminal->column += cell->width;
+    if (terminal->column >= columns)
+        terminal->column = UNKNOWN_SIZE;
+}
+
+static bool bridges_to_change(const colorizer_t *colorizer, const terminal_t *terminal, const screen_cell_t *screen_cells,
+                              size_t count, size_t index, uint32_t offset)
+{
+    const screen_cell_t *screen_cell = &screen_cells[index];
+    uint32_t column = screen_cell->column + screen_cell->cell->width;
+
+    /* Only worth it with the cursor already on the cell and no escape needed to rewrite it. */
+    if (!terminal->color_valid || terminal->row != screen_cell->row || terminal->column != screen_cell->column
+            || !same_color(colorizer, terminal->color_key, screen_cell->key))
+        return false;
+
+    for (size_t i = index + 1; i < count && i <= index + MAX_BRIDGE_CELLS; i++) {
+        uint32_t key;
+
+        if (screen_cells[i].row != screen_cell->row || screen_cells[i].column != column)
+            return false;
+        color_at_phase(colorizer, screen_cells[i].cell->phase + offset, &key);
+        if (!same_color(colorizer, screen_cells[i].key, key))
+            return true;
+        column += screen_cells[i].cell->width;
+    }
+    return false;
+}
+
+static size_t place_cells(const layout_t *layout, uint64_t lines, uint32_t rows, uint32_t columns, screen_cell_t *screen_cells,
+                          uint32_t *home_row)
+{
+    uint32_t *line_rows = calloc(lines + 1, sizeof(uint32_t));
+    uint32_t top_row;
+    uint32_t shift = 0;
+    size_t count = 0;
+
+    if (!line_rows) {
+        fwprintf(stderr, L"Out of memory\n");
+        exit(2);
+    }
+
+    /* Lines longer than the screen wrap over several rows, a wide char that does not fit at the end
+     * of a row goes to the next one. Rows are counted from the start of the line first. */
+    for (size_t i = 0; i < layout->cells_count; i++) {
+        const layout_cell_t *cell = &layout->cells[i];
+        screen_cell_t *screen_cell = &screen_cells[i];
+        uint32_t column;
+
+        if (i == 0 || cell->line != layout->cells[i - 1].line)
+            shift = 0;
+        column = cell->column + shift;
+        if (columns != UNKNOWN_SIZE && column % columns + cell->width > columns) {
+            shift += columns - column % columns;
+            column = cell->column + shift;
+        }
+
+        screen_cell->cell = cell;
+        screen_cell->row = (columns == UNKNOWN_SIZE) ? 0 : column / columns;
+        screen_cell->column = (columns == UNKNOWN_SIZE) ? column : column % columns;
+        if (screen_cell->row + 1 > line_rows[cell->line])
+            line_rows[cell->line] = screen_cell->row + 1;
+    }
+    for (uint64_t line = 0, row = 0; line <= lines; line++) {
+        uint32_t line_height = line_rows[line] ? line_rows[line] : 1;
+        line_rows[line] = row;
+        row += line_height;
+    }
+    *home_row = line_rows[lines];
+
+    /* Rows scrolled off the top cannot be reached anymore. */
+    top_row = (rows != UNKNOWN_SIZE && *home_row >= rows) ? *home_row - rows + 1 : 0;
+    for (size_t i = 0; i < layout->cells_count; i++) {
+        screen_cell_t screen_cell = screen_cells[i];
+
+        screen_cell.row += line_rows[screen_cell.cell->line];
+        if (screen_cell.row >= top_row)
+            screen_cells[count++] = screen_cell;
+    }
+
+    free(line_rows);
+    return count;
+}
+
+static void draw_text(output_buffer_t *frame, terminal_t *terminal, const colorizer_t *colorizer, const layout_t *layout,
+                      screen_cell_t *screen_cells, size_t screen_cells_count, uint32_t offset, uint32_t home_row)
+{
+    const uint8_t *text = (const uint8_t *)layout->text.data;
+    size_t position = 0;
+
+    /* The whole text, ending on a new line where the cursor rests between frames. */
+    for (size_t i = 0, next = 0; i < layout->cells_count; i++) {
+        const layout_cell_t *cell = &layout->cells[i];
+        uint32_t key;
+        const escape_code_t *escape_code = color_at_phase(colorizer, cell->phase + offset, &key);
+
+        /* Escape sequences of the text may change the color. */
+        output_append(frame, text + position, cell->offset - position);
+        if (memchr(text + position, ESCAPE_CHAR, cell->offset - position))
+            terminal->color_valid = false;
+
+        if (!terminal->color_valid || !same_color(colorizer, terminal->color_key, key)) {
+            output_append(frame, escape_code->bytes, escape_code->length);
+            terminal->color_valid = true;
+            terminal->color_key = key;
+        }
+        output_append(frame, text + cell->offset, cell->length);
+        position = cell->offset + cell->length;
+
+        if (next < screen_cells_count && screen_cells[next].cell == cell)
+            screen_cells[next++].key = terminal->color_key;
+    }
+    output_append(frame, text + position, layout->text.length - position);
+    if (memchr(text + position, ESCAPE_CHAR, layout->text.length - position))
+        terminal->color_valid = false;
+    if (!layout->text.length || text[layout->text.length - 1] != '\n')
+        output_append(frame, "\n", 1);
+    terminal->row = home_row;
+    terminal->column = 0;
+}
+
+int run_animation(queercat_stream_t *stream, const uint8_t *text, size_t length, int fps, double duration)
+{
+    colorizer_t *colorizer = &stream->colorizer;
+    layout_t layout = { 0 };
+    output_buffer_t frame = { .fd = OUTPUT_GROWABLE };
+    terminal_t terminal = { 0 };
+    struct sigaction stop_action = { .sa_handler = handle_stop };
+    struct sigaction resize_action = { .sa_handler = handle_resize };
+    struct sigaction old_interrupt;
+    struct sigaction old_terminate;
+    struct sigaction old_resize;
+    screen_cell_t *screen_cells;
+    size_t screen_cells_count;
+    uint64_t lines;
+    uint32_t home_row;
+    uint32_t rows;
+    uint32_t columns;
+    uint64_t start_ns;
+    uint64_t frame_ns = 1000000000ull / fps;
+    uint64_t frame_index;
+    bool ends_with_newline;
+
+    /* Lay the text out once, every frame only looks colors up for its cells. */
+    layout_text(colorizer, &layout, text, length);
+    ends_with_newline = layout.text.length && layout.text.data[layout.text.length - 1] == '\n';
+    lines = colorizer->line_index + !ends_with_newline;
+
+    screen_cells = malloc((layout.cells_count + 1) * sizeof(screen_cell_t));
+    if (!screen_cells) {
+        fwprintf(stderr, L"Out of memory\n");
+        exit(2);
+    }
+    read_window_size(&rows, &columns);
+    screen_cells_count = place_cells(&layout, lines, rows, columns, screen_cells, &home_row);
+
+    /* Resizing is watched from before the first frame, it may already be off. Stopping too: the
+     * cursor is hidden from the first write, it is only shown again at the end. */
+    sigaction(SIGWINCH, &resize_action, &old_resize);
+    sigaction(SIGINT, &stop_action, &old_interrupt);
+    sigaction(SIGTERM, &stop_action, &old_terminate);
+    output_append(&frame, HIDE_CURSOR, strlen(HIDE_CURSOR));
+    draw_text(&frame, &terminal, colorizer, &layout, screen_cells, screen_cells_count, 0, home_row);
+    write_all(STDOUT_FILENO, frame.data, frame.length);
+    start_ns = clock_ns(CLOCK_MONOTONIC);
+
+    while (!stop_signal) {
+        uint64_t elapsed_ns = clock_ns(CLOCK_MONOTONIC) - start_ns;
+        uint32_t offset;
+        struct timespec deadline;
+
+        if (duration > 0 && elapsed_ns >= duration * 1e9)
+            break;
+
+        /* The colors follow the clock, frames that cannot be written in time are dropped. */
+        offset = (uint32_t)(int64_t)llround(fmod(elapsed_ns / 1e9 * PERIODS_PER_SECOND, 1.0) * 4294967296.0);
+        frame.length = 0;
+
+        /* Resized, the cells moved to where the terminal rewrapped them, if it did. Place them for
+         * the new size, and draw the whole text again from the top of a cleared screen. */
+        if (window_resized) {
+            window_resized = 0;
+            read_window_size(&rows, &columns);
+            screen_cells_count = place_cells(&layout, lines, rows, columns, screen_cells, &home_row);
+            terminal = (terminal_t){ 0 };
+            output_append(&frame, CLEAR_SCREEN, strlen(CLEAR_SCREEN));
+            draw_text(&frame, &terminal, colorizer, &layout, screen_cells, screen_cells_count, offset, home_row);
+        }
+
+        for (size_t i = 0; i < screen_cells_count; i++) {
+            screen_cell_t *screen_cell = &screen_cells[i];
+            uint32_t key;
+            const escape_code_t *escape_code = color_at_phase(colorizer, screen_cell->cell->phase + offset, &key);
+
+            /* Unchanged cells are skipped, unless rewriting a few is shorter than moving over them. */
+            if (same_color(colorizer, screen_cell->key, key)) {
+                if (!bridges_to_change(colorizer, &terminal, screen_cells, screen_cells_count, i, offset))
+                    continue;
+                key = screen_cell->key;
+            }
+            draw_cell(&frame, &terminal, colorizer, (const uint8_t *)layout.text.data, screen_cell, key, escape_code, columns);
+        }
+
+        /* One write per frame, back where the text ended. */
+        if (frame.length) {
+            move_cursor(&frame, &terminal, home_row, 0);
+            write_all(STDOUT_FILENO, frame.data, frame.length);
+        }
+
+        frame_index = (clock_ns(CLOCK_MONOTONIC) - start_ns) / frame_ns + 1;
+        deadline.tv_sec = (start_ns + frame_index * frame_ns) / 1000000000ull;
+        deadline.tv_nsec = (start_ns + frame_index * frame_ns) % 1000000000ull;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+    }
+
+    write_all(STDOUT_FILENO, RESET_ESCAPE_CODE SHOW_CURSOR, strlen(RESET_ESCAPE_CODE SHOW_CURSOR));
+    sigaction(SIGINT, &old_interrupt, NULL);
+    sigaction(SIGTERM, &old_terminate, NULL);
+    sigaction(SIGWINCH, &old_resize, NULL);
+
+    free(screen_cells);
+    free(frame.data);
+    layout_free(&layout);
+
+    /* Die of the signal that stopped us, now that the terminal is back to normal. */
+    if (stop_signal)
+        raise(stop_signal);
+    return 0;
+}
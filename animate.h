@@ -0,0 +1,15 @@
+#ifndef ANIMATE_H
+#define ANIMATE_H
+
+/* *** Includes ******************************************************/
+#include <stddef.h>
+#include <stdint.h>
+#include "queercat.h"
+
+
+/* *** Functions Declarations ****************************************/
+/* Draw text once, then move its colors at fps frames per second for duration seconds (until
+ * interrupted when 0). Frames only redraw the cells that change color. Returns the exit status. */
+int run_animation(queercat_stream_t *stream, const uint8_t *text, size_t length, int fps, double duration);
+
+#endif /* ANIMATE_H */
@@ -0,0 +1,441 @@
+#define _GNU_SOURCE
+
+/* *** Includes ******************************************************/
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/* *** Constants *****************************************************/
+static char helpstr[] = "\n"
+                        "Usage: queercat_bench [--size <MiB>] [--runs <d>] [--save FILE] [--compare FILE]\n"
+                        "                      [--drain-delay <us>] [--queercat PATH] [-- QUEERCAT_ARGS...]\n"
+                        "\n"
+                        "Measure queercat throughput on synthetic inputs, for every flag in ANSI,\n"
+                        "24-bit and quantized 256-color mode.\n"
+                        "\n"
+                        "        --size <MiB>: Size of each generated input (default: 8)\n"
+                        "          --runs <d>: Keep the best of <d> runs (default: 3)\n"
+                        "         --save FILE: Save the results as a baseline\n"
+                        "      --compare FILE: Compare the results with a saved baseline\n"
+                        "  --drain-delay <us>: Wait <us> after each read of the output, like a slow pipe\n"
+                        "                      (default: 0)\n"
+                        "     --queercat PATH: queercat binary to measure\n"
+                        "  -- QUEERCAT_ARGS...: Extra arguments passed to queercat\n";
+
+#ifndef QUEERCAT_PATH
+#define QUEERCAT_PATH "./queercat"
+#endif
+
+#define MAX_RESULTS (1024)
+#define MAX_NAME_LENGTH (32)
+#define MAX_EXTRA_ARGS (32)
+#define READ_BLOCK_SIZE (64 * 1024)
+
+
+/* *** Types *********************************************************/
+/* Generated input. */
+typedef struct corpus_s {
+    const char *name;
+    void (*generate)(char *data, size_t size);
+} corpus_t;
+
+/* One measurement. */
+typedef struct result_s {
+    char corpus[MAX_NAME_LENGTH];
+    int flag;
+    char mode[MAX_NAME_LENGTH];
+    double mb_per_second;
+    double output_ratio;
+} result_t;
+
+/* Color modes measured. */
+typedef struct color_mode_s {
+    const char *name;
+    const char *argument;
+} color_mode_t;
+
+
+/* *** Functions Declarations ****************************************/
+/* Info */
+static void usage(void);
+
+/* Corpora */
+static void append_utf8(char *data, size_t size, size_t *length, const char *text);
+static void generate_ascii(char *data, size_t size);
+static void generate_cjk(char *data, size_t size);
+static void generate_emoji(char *data, size_t size);
+static void generate_escapes(char *data, size_t size);
+static void generate_long_lines(char *data, size_t size);
+static void generate_short_lines(char *data, size_t size);
+
+/* Measurement */
+static double now(void);
+static int run_queercat(const char *queercat, char **extra_args, int flag, const char *mode, const char *input_path,
+                        long drain_delay_us, size_t *output_size);
+
+/* Baselines */
+static void save_results(const char *path, const result_t *results, size_t count);
+static size_t load_results(const char *path, result_t *results, size_t max_count);
+static const result_t *find_result(const result_t *results, size_t count, const result_t *result);
+
+
+/* *** Corpora *******************************************************/
+static const corpus_t corpora[] = {
+    { "ascii", generate_ascii },
+    { "cjk", generate_cjk },
+    { "emoji", generate_emoji },
+    { "escapes", generate_escapes },
+    { "long-lines", generate_long_lines },
+    { "short-lines", generate_short_lines },
+};
+
+static const color_mode_t modes[] = {
+    { "ansi", NULL },
+    { "24bit", "-b" },
+    { "256", "-q" },
+};
+
+
+/* *** Functions *****************************************************/
+static void usage(void)
+{
+    fputs(helpstr, stderr);
+    exit(1);
+}
+
+static void append_utf8(char *data, size_t size, size_t *length, const char *text)
+{
+    size_t text_length = strlen(text);
+
+    /* Never cut a UTF-8 sequence, pad the end with newlines instead. */
+    if (*length + text_length > size) {
+        memset(data + *length, '\n', size - *length);
+        *length = size;
+        return;
+    }
+
+    memcpy(data + *length, text, text_length);
+    *length += text_length;
+}
+
+static void generate_ascii(char *data, size_t size)
+{
+    static const char letters[] = "abcdefghijklmnopqrstuvwxyz ABCDEFGHIJKLMNOPQRSTUVWXYZ 0123456789 .,;:-_/()[]";
+
+    /* Log-shaped: printable ASCII with a newline every hundred or so chars. */
+    for (size_t i = 0; i < size; i++)
+        data[i] = (rand() % 100 == 0) ? '\n' : letters[rand() % (sizeof(letters) - 1)];
+}
+
+static void generate_cjk(char *data, size_t size)
+{
+    static const char *chars[] = { "漢", "字", "か", "な", "カ", "ナ", "한", "국", "어", "、", "。" };
+    size_t length = 0;
+
+    while (length < size)
+        append_utf8(data, size, &length, (rand() % 40 == 0) ? "\n" : chars[rand() % (sizeof(chars) / sizeof(*chars))]);
+}
+
+static void generate_emoji(char *data, size_t size)
+{
+    static const char *chars[] = {
+        "👩‍💻", "🏳️‍🌈", "🏳️‍⚧️", "👍🏽", "🇫🇷", "✔️", "é", "ñ", "ą̄", " ", "a", "z"
+    };
+    size_t length = 0;
+
+    while (length < size)
+        append_utf8(data, size, &length, (rand() % 30 == 0) ? "\n" : chars[rand() % (sizeof(chars) / sizeof(*chars))]);
+}
+
+static void generate_escapes(char *data, size_t size)
+{
+    static const char *chunks[] = {
+        "\033[0m\033[01;34mdirectory\033[0m  ", "\033[01;32mscript.sh\033[0m  ", "file.txt  ",
+        "\033[01;31m\033[Kerror\033[m\033[K: ", "\033[35m\033[Ksrc/main.c\033[m\033[K\033[36m\033[K:\033[m\033[K",
+        "\033]8;;https://example.com\033\\link\033]8;;\033\\ ", "\n"
+    };
+    size_t length = 0;
+
+    /* Looks like the output of "ls --color" and "grep --color". */
+    while (length < size)
+        append_utf8(data, size, &length, chunks[rand() % (sizeof(chunks) / sizeof(*chunks))]);
+}
+
+static void generate_long_lines(char *data, size_t size)
+{
+    generate_ascii(data, size);
+
+    /* A newline every MiB. */
+    for (size_t i = 0; i < size; i++)
+        data[i] = (i % (1024 * 1024) == 1024 * 1024 - 1) ? '\n' : (data[i] == '\n' ? ' ' : data[i]);
+}
+
+static void generate_short_lines(char *data, size_t size)
+{
+    generate_ascii(data, size);
+
+    /* A newline every few chars. */
+    for (size_t i = 0; i < size; i++)
+        if (rand() % 4 == 0)
+            data[i] = '\n';
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run_queercat(const char *queercat, char **extra_args, int flag, const char *mode, const char *input_path,
+                        long drain_delay_us, size_t *output_size)
+{
+    static char block[READ_BLOCK_SIZE];
+    char flag_argument[16];
+    char *argv[8 + MAX_EXTRA_ARGS];
+    int argc = 0;
+    struct timespec drain_delay = { .tv_sec = drain_delay_us / 1000000, .tv_nsec = drain_delay_us % 1000000 * 1000 };
+    int pipe_fds[2];
+    int status;
+    pid_t pid;
+    ssize_t result;
+
+    snprintf(flag_argument, sizeof(flag_argument), "%d", flag);
+    argv[argc++] = (char *)queercat;
+    argv[argc++] = "-F";
+    argv[argc++] = "-f";
+    argv[argc++] = flag_argument;
+    if (mode)
+        argv[argc++] = (char *)mode;
+    for (char **arg = extra_args; *arg; arg++)
+        argv[argc++] = *arg;
+    argv[argc] = NULL;
+
+    if (pipe(pipe_fds)) {
+        fprintf(stderr, "Cannot create pipe: %s\n", strerror(errno));
+        exit(2);
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Cannot fork: %s\n", strerror(errno));
+        exit(2);
+    }
+
+    if (pid == 0) {
+        /* stderr is silenced, the probe for the last flag is expected to fail. */
+        int input_fd = open(input_path, O_RDONLY);
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (input_fd < 0 || null_fd < 0 || dup2(input_fd, STDIN_FILENO) < 0 || dup2(pipe_fds[1], STDOUT_FILENO) < 0
+                || dup2(null_fd, STDERR_FILENO) < 0)
+            _exit(127);
+        close(pipe_fds[0]);
+        execv(queercat, argv);
+        _exit(127);
+    }
+
+    /* Drain the output, only its size is kept. */
+    close(pipe_fds[1]);
+    *output_size = 0;
+    while ((result = read(pipe_fds[0], block, sizeof(block))) != 0) {
+        if (result < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        *output_size += result;
+        if (drain_delay_us)
+            nanosleep(&drain_delay, NULL);
+    }
+    close(pipe_fds[0]);
+
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status))
+        return -1;
+    return WEXITSTATUS(status);
+}
+
+static void save_results(const char *path, const result_t *results, size_t count)
+{
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Cannot open baseline file \"%s\": %s\n", path, strerror(errno));
+        exit(2);
+    }
+
+    for (size_t i = 0; i < count; i++)
+        fprintf(f, "%s %d %s %f %f\n", results[i].corpus, results[i].flag, results[i].mode,
+                results[i].mb_per_second, results[i].output_ratio);
+
+    if (fclose(f)) {
+        fprintf(stderr, "Error writing baseline file \"%s\": %s\n", path, strerror(errno));
+        exit(2);
+    }
+}
+
+static size_t load_results(const char *path, result_t *results, size_t max_count)
+{
+    size_t count = 0;
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Cannot open baseline file \"%s\": %s\n", path, strerror(errno));
+        exit(2);
+    }
+
+    while (count < max_count && fscanf(f, "%31s %d %31s %lf %lf", results[count].corpus, &results[count].flag,
+                                       results[count].mode, &results[count].mb_per_second, &results[count].output_ratio) == 5)
+        count++;
+
+    fclose(f);
+    return count;
+}
+
+static const result_t *find_result(const result_t *results, size_t count, const result_t *result)
+{
+    for (size_t i = 0; i < count; i++)
+        if (!strcmp(results[i].corpus, result->corpus) && results[i].flag == result->flag && !strcmp(results[i].mode, result->mode))
+            return &results[i];
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    static result_t results[MAX_RESULTS];
+    static result_t baseline[MAX_RESULTS];
+    char *extra_args[MAX_EXTRA_ARGS + 1] = { NULL };
+    const char *queercat = QUEERCAT_PATH;
+    const char *save_path = NULL;
+    const char *compare_path = NULL;
+    size_t size = 8 * 1024 * 1024;
+    size_t results_count = 0;
+    size_t baseline_count = 0;
+    int runs = 3;
+    long drain_delay_us = 0;
+    int i;
+
+    /* Handle flags. */
+    for (i = 1; i < argc; i++) {
+        char *endptr;
+        if (!strcmp(argv[i], "--size") && i + 1 < argc) {
+            size = strtod(argv[++i], &endptr) * 1024 * 1024;
+            if (*endptr || !size)
+                usage();
+        } else if (!strcmp(argv[i], "--runs") && i + 1 < argc) {
+            runs = strtol(argv[++i], &endptr, 10);
+            if (*endptr || runs < 1)
+                usage();
+        } else if (!strcmp(argv[i], "--drain-delay") && i + 1 < argc) {
+            drain_delay_us = strtol(argv[++i], &endptr, 10);
+            if (*endptr || drain_delay_us < 0)
+                usage();
+        } else if (!strcmp(argv[i], "--save") && i + 1 < argc) {
+            save_path = argv[++i];
+        } else if (!strcmp(argv[i], "--compare") && i + 1 < argc) {
+            compare_path = argv[++i];
+        } else if (!strcmp(argv[i], "--queercat") && i + 1 < argc) {
+            queercat = argv[++i];
+        } else if (!strcmp(argv[i], "--")) {
+            for (int j = 0; ++i < argc && j < MAX_EXTRA_ARGS; j++)
+                extra_args[j] = argv[i];
+            break;
+        } else {
+            usage();
+        }
+    }
+
+    if (compare_path)
+        baseline_count = load_results(compare_path, baseline, MAX_RESULTS);
+
+    char *data = malloc(size);
+    if (!data) {
+        fprintf(stderr, "Out of memory\n");
+        return 2;
+    }
+
+    printf("%-12s %4s %-6s %10s %8s%s\n", "corpus", "flag", "mode", "MB/s", "out/in", compare_path ? "   baseline    change" : "");
+
+    for (size_t c = 0; c < sizeof(corpora) / sizeof(*corpora); c++) {
+        char input_path[] = "/tmp/queercat_bench_XXXXXX";
+        int fd = mkstemp(input_path);
+
+        /* Same input on every run. */
+        srand(c + 1);
+        corpora[c].generate(data, size);
+        if (fd < 0 || write(fd, data, size) != (ssize_t)size || close(fd)) {
+            fprintf(stderr, "Cannot write input file \"%s\": %s\n", input_path, strerror(errno));
+            return 2;
+        }
+
+        /* Flags are tried in order until queercat rejects one. */
+        for (int flag = 0; ; flag++) {
+            bool valid_flag = true;
+
+            for (size_t m = 0; m < sizeof(modes) / sizeof(*modes) && valid_flag; m++) {
+                result_t *result = &results[results_count];
+                double best_time = 0;
+                size_t output_size = 0;
+
+                for (int run = 0; run < runs; run++) {
+                    double start = now();
+                    int status = run_queercat(queercat, extra_args, flag, modes[m].argument, input_path, drain_delay_us,
+                                              &output_size);
+                    double elapsed = now() - start;
+
+                    if (status == 1 && output_size == 0) {
+                        valid_flag = false;
+                        break;
+                    } else if (status != 0) {
+                        fprintf(stderr, "queercat failed with status %d\n", status);
+                        unlink(input_path);
+                        return 2;
+                    }
+
+                    if (run == 0 || elapsed < best_time)
+                        best_time = elapsed;
+                }
+                if (!valid_flag)
+                    break;
+
+                snprintf(result->corpus, sizeof(result->corpus), "%s", corpora[c].name);
+                snprintf(result->mode, sizeof(result->mode), "%s", modes[m].name);
+                result->flag = flag;
+                result->mb_per_second = size / best_time / (1024 * 1024);
+                result->output_ratio = (double)output_size / size;
+
+                printf("%-12s %4d %-6s %10.1f %8.2f", result->corpus, result->flag, result->mode,
+                       result->mb_per_second, result->output_ratio);
+                if (compare_path) {
+                    const result_t *previous = find_result(baseline, baseline_count, result);
+                    if (previous)
+                        printf(" %10.1f %+8.1f%%", previous->mb_per_second,
+                               100.0 * (result->mb_per_second / previous->mb_per_second - 1.0));
+                    else
+                        printf(" %10s %9s", "-", "-");
+                }
+                printf("\n");
+                fflush(stdout);
+
+                if (results_count + 1 < MAX_RESULTS)
+                    results_count++;
+            }
+
+            if (!valid_flag)
+                break;
+        }
+
+        unlink(input_path);
+    }
+
+    free(data);
+
+    if (save_path)
+        save_results(save_path, results, results_count);
+    return 0;
+}
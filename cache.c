@@ -0,0 +1,461 @@
+#define _GNU_SOURCE
+
+/* *** Includes ******************************************************/
+#include <stdbool.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include <unistd.h>
+#include <wchar.h>
+#include "queercat_internal.h"
+#include "cache.h"
+
+
+/* *** Constants *****************************************************/
+#define RENDER_CACHE_MAGIC "QCRENDER"
+#define RENDER_CACHE_VERSION (1)
+#define CACHE_BLOCK_SIZE (64 * 1024)
+#define MAX_ENTRY_FRACTION (8)       /* Largest entry, as a fraction of the cache size. */
+#define KEY_NAME_LENGTH (16)         /* Hex digits of a key. */
+#define HASH_MULTIPLIER (0x9e3779b97f4a7c15ull)
+
+
+/* *** Types *********************************************************/
+struct render_cache_s {
+    char *directory;
+    uint64_t max_bytes;
+};
+
+/* Stream state the output depends on, hashed into the key. Zeroed first, so padding hashes the same. */
+typedef struct render_key_s {
+    uint32_t version;
+    color_type_t color_type;
+    bool print_colors;
+    bool html_style_pending;
+    double threshold_squared;
+    uint32_t column_step;
+    uint32_t line_step;
+    uint32_t line_phase;
+    uint32_t phase;
+    unsigned int ansii_base;
+    unsigned int ansii_codes_count;
+    emitter_t emitter;
+    grapheme_state_t grapheme;
+    escape_state_t escape_state;
+} render_key_t;
+
+/* Cache entry: this header, then the colored output. The state is the one the stream ends in. */
+typedef struct render_entry_header_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t key;
+    uint64_t state_hash;
+    uint64_t input_hash;
+    uint64_t input_length;
+    uint64_t output_length;
+    uint64_t lines;
+    uint32_t line_phase;
+    uint32_t phase;
+    emitter_t emitter;
+    grapheme_state_t grapheme;
+    escape_state_t escape_state;
+    bool html_style_pending;
+    uint64_t escape_length;
+    queercat_stats_t stats;       /* Of the input alone. */
+} render_entry_header_t;
+
+/* Entry found when evicting. */
+typedef struct cache_file_s {
+    char name[KEY_NAME_LENGTH + 1];
+    uint64_t size;
+    struct timespec used;
+} cache_file_t;
+
+
+/* *** Functions Declarations ****************************************/
+/* Keys */
+static uint64_t hash_bytes(const void *bytes, size_t length, uint64_t seed);
+static uint64_t hash_state(const colorizer_t *colorizer);
+static void entry_path(const render_cache_t *cache, uint64_t key, char *path, size_t size);
+
+/* Entries */
+static bool send_entry(int fd, off_t offset, uint64_t length, int out_fd);
+static bool send_cached(render_cache_t *cache, queercat_stream_t *stream, output_buffer_t *output, uint64_t key,
+                        uint64_t state_hash, uint64_t input_hash, size_t length);
+static int create_entry(const render_cache_t *cache, uint64_t key, char *temporary_path, size_t size);
+static bool write_entry(int fd, const void *bytes, size_t length);
+static void store_entry(render_cache_t *cache, int fd, const char *temporary_path, const render_entry_header_t *header);
+static void drop_entry(int fd, const char *temporary_path);
+static int compare_use(const void *file1, const void *file2);
+static void evict(render_cache_t *cache);
+
+
+/* *** Functions *****************************************************/
+static uint64_t hash_bytes(const void *bytes, size_t length, uint64_t seed)
+{
+    const uint8_t *position = bytes;
+    uint64_t hash = seed ^ (length * HASH_MULTIPLIER);
+    uint64_t word;
+
+    /* Eight bytes at a time, each word mixed in with a multiply and a shift. */
+    for (; length >= sizeof(word); position += sizeof(word), length -= sizeof(word)) {
+        memcpy(&word, position, sizeof(word));
+        hash = (hash ^ word) * HASH_MULTIPLIER;
+        hash ^= hash >> 29;
+    }
+    word = 0;
+    memcpy(&word, position, length);
+    hash = (hash ^ word) * HASH_MULTIPLIER;
+    hash ^= hash >> 32;
+    return hash * HASH_MULTIPLIER;
+}
+
+static uint64_t hash_state(const colorizer_t *colorizer)
+{
+    render_key_t key;
+    uint64_t hash;
+
+    memset(&key, 0, sizeof(key));
+    key.version = RENDER_CACHE_VERSION;
+    key.color_type = colorizer->color_type;
+    key.print_colors = colorizer->print_colors;
+    key.html_style_pending = colorizer->html_style_pending;
+    key.threshold_squared = colorizer->threshold_squared;
+    key.column_step = colorizer->column_step;
+    key.line_step = colorizer->line_step;
+    key.line_phase = colorizer->line_phase;
+    key.phase = colorizer->phase;
+    key.ansii_base = colorizer->ansii_base;
+    key.ansii_codes_count = colorizer->ansii_codes_count;
+    key.emitter = colorizer->emitter;
+    key.grapheme = colorizer->grapheme;
+    key.escape_state = colorizer->escape_state;
+
+    /* The flag is its colors, whatever its name. */
+    hash = hash_bytes(&key, sizeof(key), 0);
+    hash = hash_bytes(colorizer->kernel->name, strlen(colorizer->kernel->name), hash);
+    hash = hash_bytes(colorizer->ansii_codes, colorizer->ansii_codes_count, hash);
+    if (colorizer->color_type != COLOR_TYPE_ANSII)
+        hash = hash_bytes(colorizer->gradient->colors, sizeof(colorizer->gradient->colors), hash);
+    return hash;
+}
+
+static void entry_path(const render_cache_t *cache, uint64_t key, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%016" PRIx64, cache->directory, key);
+}
+
+static bool send_entry(int fd, off_t offset, uint64_t length, int out_fd)
+{
+    static char block[CACHE_BLOCK_SIZE];
+
+#ifdef __linux__
+    /* Let the kernel move the bytes, the copy below picks up wherever it stops. */
+    while (length) {
+        ssize_t result = sendfile(out_fd, fd, &offset, length);
+        if (result > 0)
+            length -= result;
+        else if (result == 0 || errno != EINTR)
+            break;
+    }
+#endif
+
+    /* Plain copy. */
+    while (length) {
+        ssize_t result = pread(fd, block, (length < sizeof(block)) ? length : sizeof(block), offset);
+        if (result <= 0) {
+            if (result < 0 && errno == EINTR)
+                continue;
+            return false;
+        }
+        write_all(out_fd, block, result);
+        offset += result;
+        length -= result;
+    }
+    return true;
+}
+
+static bool send_cached(render_cache_t *cache, queercat_stream_t *stream, output_buffer_t *output, uint64_t key,
+                        uint64_t state_hash, uint64_t input_hash, size_t length)
+{
+    colorizer_t *colorizer = &stream->colorizer;
+    char path[PATH_MAX];
+    render_entry_header_t header;
+    stage_clock_t clock = { 0 };
+    struct stat entry_stat;
+    bool sent;
+    int fd;
+
+    entry_path(cache, key, path, sizeof(path));
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    /* The key only picks the file, the header has to agree with everything. */
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || fstat(fd, &entry_stat)
+            || memcmp(header.magic, RENDER_CACHE_MAGIC, sizeof(header.magic))
+            || header.version != RENDER_CACHE_VERSION || header.header_size != sizeof(header)
+            || header.key != key || header.state_hash != state_hash || header.input_hash != input_hash
+            || header.input_length != length || (uint64_t)entry_stat.st_size != sizeof(header) + header.output_length) {
+        close(fd);
+        return false;
+    }
+
+    /* Used now, evicted last. */
+    futimens(fd, NULL);
+
+    output_flush(output);
+    if (output->stats)
+        stage_begin(&clock);
+    sent = send_entry(fd, sizeof(header), header.output_length, output->fd);
+    if (output->stats)
+        stage_end(output->stats, &clock, header.output_length);
+    close(fd);
+    if (!sent) {
+        fwprintf(stderr, L"Cannot read cached output \"%s\": %s\n", path, strerror(errno));
+        exit(2);
+    }
+
+    /* Carry on from where coloring the input would have left the stream. */
+    colorizer->line_index += header.lines;
+    colorizer->line_phase = header.line_phase;
+    colorizer->phase = header.phase;
+    colorizer->emitter = header.emitter;
+    colorizer->grapheme = header.grapheme;
+    colorizer->escape_state = header.escape_state;
+    colorizer->escape_length = header.escape_length;
+    colorizer->html_style_pending = header.html_style_pending;
+    colorizer->stats.chars += header.stats.chars;
+    colorizer->stats.invalid_bytes += header.stats.invalid_bytes;
+    colorizer->stats.escape_bytes += header.stats.escape_bytes;
+    colorizer->stats.colors_emitted += header.stats.colors_emitted;
+    colorizer->stats.colors_suppressed += header.stats.colors_suppressed;
+    colorizer->stats.escape_sequences += header.stats.escape_sequences;
+    return true;
+}
+
+static int create_entry(const render_cache_t *cache, uint64_t key, char *temporary_path, size_t size)
+{
+    int fd;
+
+    /* Written aside and renamed in once complete, so readers never see half of it. The header
+     * goes first, once the output is all there. */
+    snprintf(temporary_path, size, "%s/.%016" PRIx64 ".XXXXXX", cache->directory, key);
+    fd = mkostemp(temporary_path, O_CLOEXEC);
+    if (fd >= 0 && lseek(fd, sizeof(render_entry_header_t), SEEK_SET) < 0) {
+        drop_entry(fd, temporary_path);
+        return -1;
+    }
+    return fd;
+}
+
+static bool write_entry(int fd, const void *bytes, size_t length)
+{
+    while (length) {
+        ssize_t result = write(fd, bytes, length);
+        if (result < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        bytes = (const char *)bytes + result;
+        length -= result;
+    }
+    return true;
+}
+
+static void store_entry(render_cache_t *cache, int fd, const char *temporary_path, const render_entry_header_t *header)
+{
+    char path[PATH_MAX];
+    bool written;
+
+    /* The cache only saves time, failing to write it is not an error. */
+    entry_path(cache, header->key, path, sizeof(path));
+    written = pwrite(fd, header, sizeof(*header), 0) == sizeof(*header);
+    written = !close(fd) && written;
+    if (!written || rename(temporary_path, path)) {
+        unlink(temporary_path);
+        return;
+    }
+
+    evict(cache);
+}
+
+static void drop_entry(int fd, const char *temporary_path)
+{
+    close(fd);
+    unlink(temporary_path);
+}
+
+static int compare_use(const void *file1, const void *file2)
+{
+    const struct timespec *used1 = &((const cache_file_t *)file1)->used;
+    const struct timespec *used2 = &((const cache_file_t *)file2)->used;
+
+    if (used1->tv_sec != used2->tv_sec)
+        return (used1->tv_sec < used2->tv_sec) ? -1 : 1;
+    return (used1->tv_nsec > used2->tv_nsec) - (used1->tv_nsec < used2->tv_nsec);
+}
+
+static void evict(render_cache_t *cache)
+{
+    DIR *directory = opendir(cache->directory);
+    cache_file_t *files = NULL;
+    size_t files_count = 0;
+    size_t files_capacity = 0;
+    uint64_t total = 0;
+    struct dirent *entry;
+
+    if (!directory)
+        return;
+
+    /* Entries are named by their key, anything else (such as entries being written) is left alone. */
+    while ((entry = readdir(directory))) {
+        struct stat entry_stat;
+
+        if (strlen(entry->d_name) != KEY_NAME_LENGTH || strspn(entry->d_name, "0123456789abcdef") != KEY_NAME_LENGTH
+                || fstatat(dirfd(directory), entry->d_name, &entry_stat, AT_SYMLINK_NOFOLLOW) || !S_ISREG(entry_stat.st_mode))
+            continue;
+
+        if (files_count == files_capacity) {
+            cache_file_t *grown;
+
+            files_capacity = files_capacity ? 2 * files_capacity : 64;
+            grown = realloc(files, files_capacity * sizeof(cache_file_t));
+            if (!grown)
+                break;
+            files = grown;
+        }
+        memcpy(files[files_count].name, entry->d_name, KEY_NAME_LENGTH + 1);
+        files[files_count].size = entry_stat.st_size;
+        files[files_count].used = entry_stat.st_mtim;
+        files_count++;
+        total += entry_stat.st_size;
+    }
+
+    /* Least recently used first, until the rest fits. */
+    if (total > cache->max_bytes) {
+        qsort(files, files_count, sizeof(cache_file_t), compare_use);
+        for (size_t i = 0; i < files_count && total > cache->max_bytes; i++) {
+            if (!unlinkat(dirfd(directory), files[i].name, 0))
+                total -= files[i].size;
+        }
+    }
+
+    free(files);
+    closedir(directory);
+}
+
+render_cache_t *render_cache_open(const char *directory, uint64_t max_bytes)
+{
+    render_cache_t *cache;
+
+    if (mkdir(directory, 0700) && errno != EEXIST)
+        return NULL;
+
+    cache = calloc(1, sizeof(*cache));
+    if (!cache)
+        return NULL;
+    cache->directory = strdup(directory);
+    if (!cache->directory) {
+        free(cache);
+        return NULL;
+    }
+    cache->max_bytes = max_bytes;
+    return cache;
+}
+
+void render_cache_close(render_cache_t *cache)
+{
+    if (!cache)
+        return;
+    free(cache->directory);
+    free(cache);
+}
+
+bool render_cache_colorize(render_cache_t *cache, queercat_stream_t *stream, output_buffer_t *output,
+                           const uint8_t *input, size_t length)
+{
+    colorizer_t *colorizer = &stream->colorizer;
+    render_entry_header_t header;
+    char temporary_path[PATH_MAX];
+    uint64_t max_entry_bytes = cache->max_bytes / MAX_ENTRY_FRACTION;
+    queercat_stats_t stats = colorizer->stats;
+    uint64_t line_index = colorizer->line_index;
+    uint64_t output_length = 0;
+    size_t consumed;
+    int fd;
+
+    /* A char cut by the last input would make this one depend on it. */
+    if (stream->carry_length || length > max_entry_bytes)
+        return false;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RENDER_CACHE_MAGIC, sizeof(header.magic));
+    header.version = RENDER_CACHE_VERSION;
+    header.header_size = sizeof(header);
+    header.state_hash = hash_state(colorizer);
+    header.input_hash = hash_bytes(input, length, 0);
+    header.input_length = length;
+    header.key = hash_bytes(&header.state_hash, sizeof(header.state_hash), header.input_hash);
+
+    if (send_cached(cache, stream, output, header.key, header.state_hash, header.input_hash, length))
+        return true;
+
+    /* Each block goes out as soon as it is colored, and into the entry while it stays small enough
+     * to store. Past that the input is only colored. */
+    fd = create_entry(cache, header.key, temporary_path, sizeof(temporary_path));
+    output_flush(output);
+    for (size_t position = 0; position < length; position += consumed) {
+        ssize_t written = queercat_stream_feed(stream, input + position, length - position, output->data, output->capacity,
+                                               &consumed);
+        if (written < 0) {
+            fwprintf(stderr, L"Cannot colorize the input: %s\n", strerror(errno));
+            exit(2);
+        }
+
+        output->length = written;
+        output_length += written;
+        if (fd >= 0 && (output_length > max_entry_bytes || !write_entry(fd, output->data, output->length))) {
+            drop_entry(fd, temporary_path);
+            fd = -1;
+        }
+        output_flush(output);
+    }
+    if (fd < 0)
+        return true;
+
+    header.output_length = output_length;
+    header.lines = colorizer->line_index - line_index;
+    header.line_phase = colorizer->line_phase;
+    header.phase = colorizer->phase;
+    header.emitter = colorizer->emitter;
+    header.grapheme = colorizer->grapheme;
+    header.escape_state = colorizer->escape_state;
+    header.escape_length = colorizer->escape_length;
+    header.html_style_pending = colorizer->html_style_pending;
+    header.stats.chars = colorizer->stats.chars - stats.chars;
+    header.stats.invalid_bytes = colorizer->stats.invalid_bytes - stats.invalid_bytes;
+    header.stats.escape_bytes = colorizer->stats.escape_bytes - stats.escape_bytes;
+    header.stats.colors_emitted = colorizer->stats.colors_emitted - stats.colors_emitted;
+    header.stats.colors_suppressed = colorizer->stats.colors_suppressed - stats.colors_suppressed;
+    header.stats.escape_sequences = colorizer->stats.escape_sequences - stats.escape_sequences;
+
+    /* Inputs ending in a cut char leave it in the stream, they are not stored. */
+    if (stream->carry_length)
+        drop_entry(fd, temporary_path);
+    else
+        store_entry(cache, fd, temporary_path, &header);
+    return true;
+}
@@ -0,0 +1,29 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+/* *** Includes ******************************************************/
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "queercat_internal.h"
+
+
+/* *** Types *********************************************************/
+/* Directory of colored outputs, keyed by their input and the stream state it was colored from. */
+typedef struct render_cache_s render_cache_t;
+
+
+/* *** Functions Declarations ****************************************/
+/* Open the cache in directory, keeping it under max_bytes. Returns NULL, with errno set, when it
+ * cannot be created. */
+render_cache_t *render_cache_open(const char *directory, uint64_t max_bytes);
+void render_cache_close(render_cache_t *cache);
+
+/* Colorize input with the stream to output, sending the cached output when there is one and
+ * storing it otherwise, unless it gets too big for the cache. Output is written out as it is
+ * colored. The stream ends as if it had been fed the input. Returns false, having done nothing,
+ * when the input cannot be cached. */
+bool render_cache_colorize(render_cache_t *cache, queercat_stream_t *stream, output_buffer_t *output,
+                           const uint8_t *input, size_t length);
+
+#endif /* CACHE_H */
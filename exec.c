@@ -0,0 +1,296 @@
+#define _GNU_SOURCE
+
+/* *** Includes ******************************************************/
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+#include <wchar.h>
+#include "queercat_internal.h"
+#include "exec.h"
+
+
+/* *** Constants *****************************************************/
+#define EXEC_BLOCK_SIZE (16 * 1024)  /* Terminal output comes in small reads, keep them small. */
+#define EXIT_STATUS_SIGNALED (128)
+#define EXIT_STATUS_NOT_FOUND (127)
+
+
+/* *** Types *********************************************************/
+/* Pseudo-terminal of the command, how our terminal was before it, and the input read from
+ * stdin that the command's terminal did not take yet. */
+typedef struct command_s {
+    int master_fd;
+    pid_t pid;
+    bool stdin_is_terminal;
+    struct termios stdin_termios;
+    char input[EXEC_BLOCK_SIZE];
+    size_t input_offset;
+    size_t input_length;
+    bool partial_line;            /* The last input read did not end with a newline. */
+} command_t;
+
+
+/* *** Functions Declarations ****************************************/
+static void handle_signal(int signal_number);
+static int open_terminal(command_t *command, char **slave_path);
+static void start_command(command_t *command, const char *slave_path, char **argv);
+static void copy_window_size(const command_t *command);
+static bool read_input(command_t *command);
+static void write_input(command_t *command);
+static bool colorize_output(queercat_stream_t *stream, output_buffer_t *output, int master_fd);
+
+
+/* *** Globals *******************************************************/
+/* Set by the handlers, while the signals are only let through during ppoll. */
+static volatile sig_atomic_t window_resized;
+static volatile sig_atomic_t child_exited;
+static volatile sig_atomic_t forwarded_signal;
+
+static const int handled_signals[] = { SIGWINCH, SIGCHLD, SIGINT, SIGTERM, SIGHUP, SIGQUIT };
+
+
+/* *** Functions *****************************************************/
+static void handle_signal(int signal_number)
+{
+    if (signal_number == SIGWINCH)
+        window_resized = 1;
+    else if (signal_number == SIGCHLD)
+        child_exited = 1;
+    else
+        forwarded_signal = signal_number;
+}
+
+static int open_terminal(command_t *command, char **slave_path)
+{
+    struct termios slave_termios;
+
+    command->master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (command->master_fd < 0 || grantpt(command->master_fd) || unlockpt(command->master_fd))
+        return -1;
+
+    /* It starts as our terminal was, before any input reaches it. Input that does not come from
+     * a terminal is not echoed. */
+    if (command->stdin_is_terminal) {
+        tcsetattr(command->master_fd, TCSANOW, &command->stdin_termios);
+    } else if (!tcgetattr(command->master_fd, &slave_termios)) {
+        slave_termios.c_lflag &= ~ECHO;
+        tcsetattr(command->master_fd, TCSANOW, &slave_termios);
+    }
+
+    *slave_path = ptsname(command->master_fd);
+    return *slave_path ? 0 : -1;
+}
+
+static void start_command(command_t *command, const char *slave_path, char **argv)
+{
+    sigset_t empty_set;
+    int slave_fd;
+
+    sigemptyset(&empty_set);
+    command->pid = fork();
+    if (command->pid != 0)
+        return;
+
+    /* In the child: a session of its own, with the terminal as its controlling terminal and
+     * standard streams. Our signal mask is not for it. */
+    sigprocmask(SIG_SETMASK, &empty_set, NULL);
+    setsid();
+    slave_fd = open(slave_path, O_RDWR);
+    if (slave_fd < 0) {
+        fwprintf(stderr, L"Cannot open the terminal \"%s\": %s\n", slave_path, strerror(errno));
+        _exit(EXIT_STATUS_NOT_FOUND);
+    }
+    ioctl(slave_fd, TIOCSCTTY, 0);
+    dup2(slave_fd, STDIN_FILENO);
+    dup2(slave_fd, STDOUT_FILENO);
+    dup2(slave_fd, STDERR_FILENO);
+    if (slave_fd > STDERR_FILENO)
+        close(slave_fd);
+
+    execvp(argv[0], argv);
+    fwprintf(stderr, L"Cannot run \"%s\": %s\n", argv[0], strerror(errno));
+    _exit(EXIT_STATUS_NOT_FOUND);
+}
+
+static void copy_window_size(const command_t *command)
+{
+    struct winsize size;
+
+    /* As big as our terminal. The kernel sends SIGWINCH to the command when the size changes. */
+    if (!ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) || !ioctl(STDIN_FILENO, TIOCGWINSZ, &size))
+        ioctl(command->master_fd, TIOCSWINSZ, &size);
+}
+
+static bool read_input(command_t *command)
+{
+    ssize_t result = read(STDIN_FILENO, command->input, sizeof(command->input));
+
+    if (result < 0)
+        return errno == EINTR || errno == EAGAIN;
+
+    /* At the end of a piped stdin, the command reads an end of file from its terminal. After a
+     * partial line, the first VEOF only sends the line, the second one ends the input. */
+    if (result == 0) {
+        struct termios slave_termios;
+        if (!command->stdin_is_terminal && !tcgetattr(command->master_fd, &slave_termios)) {
+            command->input[0] = slave_termios.c_cc[VEOF];
+            command->input[1] = slave_termios.c_cc[VEOF];
+            command->input_offset = 0;
+            command->input_length = command->partial_line ? 2 : 1;
+        }
+        return false;
+    }
+
+    command->input_offset = 0;
+    command->input_length = result;
+    command->partial_line = command->input[result - 1] != '\n';
+    return true;
+}
+
+static void write_input(command_t *command)
+{
+    /* Never blocks: a command not reading its input may be waiting for its output to be read. */
+    ssize_t result = write(command->master_fd, command->input + command->input_offset,
+                           command->input_length - command->input_offset);
+
+    if (result < 0 && errno != EINTR && errno != EAGAIN) {
+        command->input_length = 0;
+        return;
+    }
+    if (result > 0)
+        command->input_offset += result;
+    if (command->input_offset == command->input_length)
+        command->input_length = 0;
+}
+
+static bool colorize_output(queercat_stream_t *stream, output_buffer_t *output, int master_fd)
+{
+    static uint8_t block[EXEC_BLOCK_SIZE];
+    ssize_t result = read(master_fd, block, sizeof(block));
+
+    /* EIO once the command and all it started closed the terminal. */
+    if (result <= 0)
+        return result < 0 && (errno == EINTR || errno == EAGAIN);
+
+    /* Written out at once, the command is waiting to be seen. */
+    output->length = queercat_stream_feed(stream, block, result, output->data, output->capacity, NULL);
+    output_flush(output);
+    return true;
+}
+
+int run_exec(queercat_stream_t *stream, char **argv)
+{
+    static command_t command = { .master_fd = -1, .pid = -1 };
+    output_buffer_t output = { .fd = STDOUT_FILENO, .capacity = queercat_output_bound(EXEC_BLOCK_SIZE) };
+    struct sigaction signal_action = { .sa_handler = handle_signal };
+    struct sigaction old_actions[sizeof(handled_signals) / sizeof(handled_signals[0])];
+    sigset_t handled_set;
+    sigset_t poll_set;
+    struct pollfd fds[2];
+    bool reading_input;
+    bool running = true;
+    char *slave_path;
+    int wait_status = 0;
+
+    output.data = malloc(output.capacity);
+    command.stdin_is_terminal = !tcgetattr(STDIN_FILENO, &command.stdin_termios);
+    if (!output.data || open_terminal(&command, &slave_path)) {
+        fwprintf(stderr, L"Cannot open a terminal: %s\n", strerror(errno));
+        exit(2);
+    }
+    copy_window_size(&command);
+
+    /* The signals only come in during ppoll, so none is missed between a check and the wait. */
+    sigemptyset(&handled_set);
+    for (size_t i = 0; i < sizeof(handled_signals) / sizeof(handled_signals[0]); i++) {
+        sigaddset(&handled_set, handled_signals[i]);
+        sigaction(handled_signals[i], &signal_action, &old_actions[i]);
+    }
+    sigprocmask(SIG_BLOCK, &handled_set, &poll_set);
+    for (size_t i = 0; i < sizeof(handled_signals) / sizeof(handled_signals[0]); i++)
+        sigdelset(&poll_set, handled_signals[i]);
+
+    start_command(&command, slave_path, argv);
+    if (command.pid < 0) {
+        fwprintf(stderr, L"Cannot run \"%s\": %s\n", argv[0], strerror(errno));
+        exit(2);
+    }
+
+    /* Keys go to the command as they are typed, its terminal does the echo and line editing. */
+    if (command.stdin_is_terminal) {
+        struct termios raw_termios = command.stdin_termios;
+        cfmakeraw(&raw_termios);
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw_termios);
+    }
+    reading_input = true;
+
+    /* Both ways go through without blocking, input waits in its buffer until the terminal takes it. */
+    fcntl(command.master_fd, F_SETFL, fcntl(command.master_fd, F_GETFL) | O_NONBLOCK);
+    while (running) {
+        bool input_pending = command.input_length > 0;
+
+        fds[0] = (struct pollfd){ .fd = command.master_fd, .events = POLLIN | (input_pending ? POLLOUT : 0) };
+        fds[1] = (struct pollfd){ .fd = (reading_input && !input_pending) ? STDIN_FILENO : -1, .events = POLLIN };
+
+        if (ppoll(fds, 2, NULL, &poll_set) < 0 && errno != EINTR)
+            break;
+
+        if (window_resized) {
+            window_resized = 0;
+            copy_window_size(&command);
+        }
+        if (forwarded_signal) {
+            kill(command.pid, forwarded_signal);
+            forwarded_signal = 0;
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+            running = colorize_output(stream, &output, command.master_fd);
+        if (input_pending && (fds[0].revents & POLLOUT))
+            write_input(&command);
+        if (fds[1].fd >= 0 && (fds[1].revents & (POLLIN | POLLHUP | POLLERR)))
+            reading_input = read_input(&command);
+
+        /* Once the command is gone, whatever it left in its terminal is the end of the output. */
+        if (child_exited) {
+            child_exited = 0;
+            if (waitpid(command.pid, &wait_status, WNOHANG) == command.pid) {
+                do {
+                    errno = 0;
+                } while (colorize_output(stream, &output, command.master_fd) && errno != EAGAIN);
+                command.pid = -1;
+                running = false;
+            }
+        }
+    }
+
+    if (command.stdin_is_terminal)
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &command.stdin_termios);
+    output.length = queercat_stream_flush(stream, output.data, output.capacity);
+    output_flush(&output);
+
+    /* The terminal closed with the command still running, wait for it anyway. */
+    if (command.pid > 0)
+        while (waitpid(command.pid, &wait_status, 0) < 0 && errno == EINTR)
+            continue;
+
+    sigprocmask(SIG_UNBLOCK, &handled_set, NULL);
+    for (size_t i = 0; i < sizeof(handled_signals) / sizeof(handled_signals[0]); i++)
+        sigaction(handled_signals[i], &old_actions[i], NULL);
+    close(command.master_fd);
+    free(output.data);
+
+    if (WIFSIGNALED(wait_status))
+        return EXIT_STATUS_SIGNALED + WTERMSIG(wait_status);
+    return WEXITSTATUS(wait_status);
+}
@@ -0,0 +1,14 @@
+#ifndef EXEC_H
+#define EXEC_H
+
+/* *** Includes ******************************************************/
+#include "queercat.h"
+
+
+/* *** Functions Declarations ****************************************/
+/* Run the command argv on a pseudo-terminal, with stdin forwarded to it, and colorize its
+ * output with the stream as it comes. Window size changes and signals are passed on. Returns
+ * the exit status of the command, 128 plus the signal number if a signal killed it. */
+int run_exec(queercat_stream_t *stream, char **argv);
+
+#endif /* EXEC_H */
@@ -0,0 +1,352 @@
+#define _GNU_SOURCE
+
+/* *** Includes ******************************************************/
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <wchar.h>
+#include "queercat_internal.h"
+#include "follow.h"
+
+
+/* *** Constants *****************************************************/
+#define FOLLOW_BLOCK_SIZE (64 * 1024)
+#define FOLLOW_BATCH_BLOCKS (2)
+#define FOLLOW_SWITCH_TIMEOUT_MS (1000)
+#define FILE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
+#define DIRECTORY_EVENTS (IN_CREATE | IN_MOVED_TO)
+#define EVENTS_BUFFER_SIZE (64 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+
+
+/* *** Types *********************************************************/
+/* File followed by its name, and the stream coloring it. */
+typedef struct followed_file_s {
+    const char *path;
+    char *directory;
+    const char *name;             /* In directory. */
+    int fd;                       /* -1 while there is no file by that name. */
+    dev_t device;
+    ino_t inode;
+    off_t offset;
+    int wd;
+    int directory_wd;
+    queercat_stream_t *stream;
+    bool deferred;                /* Appended to while the last file was inside a char or escape sequence. */
+} followed_file_t;
+
+typedef struct follower_s {
+    int inotify_fd;
+    followed_file_t *files;
+    size_t files_count;
+    const followed_file_t *last_file; /* Whose output was written last, for the headers. */
+    output_buffer_t output;
+} follower_t;
+
+
+/* *** Functions Declarations ****************************************/
+static void handle_stop(int signal_number);
+static bool at_boundary(const followed_file_t *file);
+static void flush_last_file(follower_t *follower);
+static void switch_to(follower_t *follower, followed_file_t *file);
+static void read_file(follower_t *follower, followed_file_t *file);
+static void read_deferred(follower_t *follower);
+static void open_file(follower_t *follower, followed_file_t *file, bool from_end);
+static void check_file(follower_t *follower, followed_file_t *file);
+static void handle_event(follower_t *follower, const struct inotify_event *event);
+
+
+/* *** Globals *******************************************************/
+static volatile sig_atomic_t stop_signal;
+
+
+/* *** Functions *****************************************************/
+static void handle_stop(int signal_number)
+{
+    stop_signal = signal_number;
+}
+
+static bool at_boundary(const followed_file_t *file)
+{
+    return !file->stream->carry_length && !queercat_stream_pending_escape(file->stream);
+}
+
+static void flush_last_file(follower_t *follower)
+{
+    queercat_stream_t *stream = follower->last_file->stream;
+
+    output_reserve(&follower->output, queercat_output_bound(0));
+    follower->output.length += queercat_stream_flush(stream, follower->output.data + follower->output.length,
+                                                     follower->output.capacity - follower->output.length);
+}
+
+static void switch_to(follower_t *follower, followed_file_t *file)
+{
+    output_buffer_t *output = &follower->output;
+    const followed_file_t *last_file = follower->last_file;
+
+    if (last_file == file)
+        return;
+
+    /* Name the file, as tail does, in no color. Its stream has to send its color again. */
+    if (last_file && last_file->stream->colorizer.print_colors)
+        output_append(output, RESET_ESCAPE_CODE, strlen(RESET_ESCAPE_CODE));
+    if (follower->files_count > 1) {
+        if (last_file)
+            output_append(output, "\n", 1);
+        output_append(output, "==> ", strlen("==> "));
+        output_append(output, file->path, strlen(file->path));
+        output_append(output, " <==\n", strlen(" <==\n"));
+    }
+    file->stream->colorizer.emitter.valid = false;
+    follower->last_file = file;
+}
+
+static void read_file(follower_t *follower, followed_file_t *file)
+{
+    static uint8_t block[FOLLOW_BLOCK_SIZE];
+    output_buffer_t *output = &follower->output;
+    struct stat file_stat;
+    ssize_t result;
+
+    if (file->fd < 0)
+        return;
+
+    /* The header of another file would cut the last one's char or escape sequence on screen, it
+     * waits for the rest of it. */
+    file->deferred = follower->last_file && follower->last_file != file && !at_boundary(follower->last_file);
+    if (file->deferred)
+        return;
+
+    /* Shorter than what was read, it was truncated: start over. */
+    if (!fstat(file->fd, &file_stat) && S_ISREG(file_stat.st_mode) && file_stat.st_size < file->offset) {
+        fwprintf(stderr, L"queercat: %s: file truncated\n", file->path);
+        file->offset = lseek(file->fd, 0, SEEK_SET);
+    }
+
+    /* Only what was appended since the last read. */
+    while ((result = read(file->fd, block, sizeof(block))) != 0) {
+        if (result < 0) {
+            if (errno == EINTR)
+                continue;
+            fwprintf(stderr, L"Error reading input file \"%s\": %s\n", file->path, strerror(errno));
+            return;
+        }
+
+        switch_to(follower, file);
+        if (output->capacity - output->length < queercat_output_bound(result))
+            output_flush(output);
+        output->length += queercat_stream_feed(file->stream, block, result, output->data + output->length,
+                                               output->capacity - output->length, NULL);
+        file->offset += result;
+    }
+}
+
+static void read_deferred(follower_t *follower)
+{
+    for (size_t i = 0; i < follower->files_count; i++) {
+        if (follower->files[i].deferred)
+            read_file(follower, &follower->files[i]);
+    }
+}
+
+static void open_file(follower_t *follower, followed_file_t *file, bool from_end)
+{
+    struct stat file_stat;
+
+    /* Watch before reading, so nothing appended in between is missed. */
+    file->wd = inotify_add_watch(follower->inotify_fd, file->path, FILE_EVENTS);
+    file->fd = open(file->path, O_RDONLY | O_CLOEXEC);
+    if (file->fd < 0 || fstat(file->fd, &file_stat)) {
+        if (file->fd >= 0)
+            close(file->fd);
+        if (file->wd >= 0)
+            inotify_rm_watch(follower->inotify_fd, file->wd);
+        file->fd = -1;
+        file->wd = -1;
+        return;
+    }
+
+    file->device = file_stat.st_dev;
+    file->inode = file_stat.st_ino;
+    /* Only what is appended from now on, as tail -F -n0, unless the file is new. */
+    if (from_end) {
+        file->offset = lseek(file->fd, 0, SEEK_END);
+        return;
+    }
+    file->offset = 0;
+    read_file(follower, file);
+}
+
+static void check_file(follower_t *follower, followed_file_t *file)
+{
+    struct stat path_stat;
+
+    /* Renamed or removed, with nothing new by its name yet: the writer may still be finishing it. */
+    if (stat(file->path, &path_stat)) {
+        read_file(follower, file);
+        return;
+    }
+    if (file->fd >= 0 && path_stat.st_dev == file->device && path_stat.st_ino == file->inode)
+        return;
+
+    /* Rotated: the rest of the old file, then the new one from its start. */
+    if (file->fd >= 0) {
+        read_file(follower, file);
+        close(file->fd);
+        if (file->wd >= 0)
+            inotify_rm_watch(follower->inotify_fd, file->wd);
+        fwprintf(stderr, L"queercat: %s: file replaced, following the new file\n", file->path);
+    } else {
+        fwprintf(stderr, L"queercat: %s: file appeared, following it\n", file->path);
+    }
+    open_file(follower, file, false);
+}
+
+static void handle_event(follower_t *follower, const struct inotify_event *event)
+{
+    /* Events were lost, look at every file. */
+    if (event->mask & IN_Q_OVERFLOW) {
+        for (size_t i = 0; i < follower->files_count; i++) {
+            check_file(follower, &follower->files[i]);
+            read_file(follower, &follower->files[i]);
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < follower->files_count; i++) {
+        followed_file_t *file = &follower->files[i];
+
+        if (event->wd == file->wd) {
+            if (event->mask & IN_MODIFY)
+                read_file(follower, file);
+            if (event->mask & (IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF))
+                check_file(follower, file);
+            if (event->mask & IN_IGNORED)
+                file->wd = -1;
+        } else if (event->wd == file->directory_wd && event->len && !strcmp(event->name, file->name)) {
+            check_file(follower, file);
+        }
+    }
+}
+
+int run_follow(const queercat_options_t *options, char **filenames, size_t filenames_count)
+{
+    static char events[EVENTS_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    follower_t follower = {
+        .files = calloc(filenames_count, sizeof(followed_file_t)),
+        .files_count = filenames_count,
+        .output = { .fd = STDOUT_FILENO, .capacity = FOLLOW_BATCH_BLOCKS * queercat_output_bound(FOLLOW_BLOCK_SIZE) }
+    };
+    struct sigaction stop_action = { .sa_handler = handle_stop };
+    int status = 0;
+
+    follower.output.data = malloc(follower.output.capacity);
+    follower.inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (!follower.files || !follower.output.data || follower.inotify_fd < 0) {
+        fwprintf(stderr, L"Cannot follow the files: %s\n", strerror(errno));
+        exit(2);
+    }
+
+    /* Each file by its name, with a stream of its own, from its end. Its directory is watched
+     * for a new file by that name. */
+    for (size_t i = 0; i < filenames_count; i++) {
+        followed_file_t *file = &follower.files[i];
+        char *path_copy = strdup(filenames[i]);
+
+        if (!strcmp(filenames[i], "-") || !strcmp(filenames[i], "--help")) {
+            fwprintf(stderr, L"Cannot follow \"%s\", only files\n", filenames[i]);
+            exit(1);
+        }
+
+        file->path = filenames[i];
+        file->directory = path_copy ? strdup(dirname(path_copy)) : NULL;
+        file->name = strrchr(file->path, '/') ? strrchr(file->path, '/') + 1 : file->path;
+        file->stream = queercat_stream_new(options);
+        free(path_copy);
+        if (!file->directory || !file->stream) {
+            fwprintf(stderr, L"Cannot follow \"%s\": %s\n", file->path, strerror(errno));
+            exit(2);
+        }
+
+        file->directory_wd = inotify_add_watch(follower.inotify_fd, file->directory, DIRECTORY_EVENTS);
+        if (file->directory_wd < 0) {
+            fwprintf(stderr, L"Cannot watch \"%s\": %s\n", file->directory, strerror(errno));
+            exit(2);
+        }
+        open_file(&follower, file, true);
+        if (file->fd < 0)
+            fwprintf(stderr, L"queercat: %s: cannot open, following its name: %s\n", file->path, strerror(errno));
+    }
+
+    /* No SA_RESTART, the signal ends the wait for events. */
+    sigaction(SIGINT, &stop_action, NULL);
+    sigaction(SIGTERM, &stop_action, NULL);
+
+    /* Idle in poll until something changes. What a batch of events appended goes out in one write.
+     * Files waiting on the last one's char or escape sequence wait FOLLOW_SWITCH_TIMEOUT_MS at
+     * most, then its stream is ended for them. */
+    while (!stop_signal) {
+        struct pollfd inotify_poll = { .fd = follower.inotify_fd, .events = POLLIN };
+        bool deferred = false;
+        ssize_t length;
+        int ready;
+
+        output_flush(&follower.output);
+        for (size_t i = 0; i < follower.files_count; i++)
+            deferred = deferred || follower.files[i].deferred;
+        ready = poll(&inotify_poll, 1, deferred ? FOLLOW_SWITCH_TIMEOUT_MS : -1);
+        if (!ready) {
+            flush_last_file(&follower);
+            read_deferred(&follower);
+            continue;
+        }
+        length = (ready < 0) ? -1 : read(follower.inotify_fd, events, sizeof(events));
+        if (length < 0) {
+            if (errno == EINTR)
+                continue;
+            fwprintf(stderr, L"Cannot follow the files: %s\n", strerror(errno));
+            status = 2;
+            break;
+        }
+
+        for (char *position = events; position < events + length; ) {
+            const struct inotify_event *event = (const struct inotify_event *)position;
+
+            handle_event(&follower, event);
+            position += sizeof(struct inotify_event) + event->len;
+        }
+        read_deferred(&follower);
+    }
+
+    /* Leave the terminal in its colors. */
+    if (follower.last_file)
+        flush_last_file(&follower);
+    output_flush(&follower.output);
+
+    for (size_t i = 0; i < filenames_count; i++) {
+        if (follower.files[i].fd >= 0)
+            close(follower.files[i].fd);
+        free(follower.files[i].directory);
+        queercat_stream_free(follower.files[i].stream);
+    }
+    close(follower.inotify_fd);
+    free(follower.files);
+    free(follower.output.data);
+
+    if (stop_signal) {
+        signal(stop_signal, SIG_DFL);
+        raise(stop_signal);
+    }
+    return status;
+}
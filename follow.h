@@ -0,0 +1,15 @@
+#ifndef FOLLOW_H
+#define FOLLOW_H
+
+/* *** Includes ******************************************************/
+#include <stddef.h>
+#include "queercat.h"
+
+
+/* *** Functions Declarations ****************************************/
+/* Colorize what is appended to the files until interrupted, each with a stream of its own.
+ * Files that appear, are replaced or are truncated are followed from their start. The header of
+ * a file waits for the last one to end its char or escape sequence. Returns the exit status. */
+int run_follow(const queercat_options_t *options, char **filenames, size_t filenames_count);
+
+#endif /* FOLLOW_H */
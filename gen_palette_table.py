@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+"""Generate palette_table.h, the nearest xterm 256-color code of every RGB color.
+
+Usage: gen_palette_table.py [OUTPUT]
+
+RGB colors are cut into CELLS^3 cells, each one mapped to the palette color nearest to its center
+in Oklab, where distances follow perceived differences better than in RGB. The 16 first codes are
+left out, terminals theme them and their colors are not known.
+"""
+
+import sys
+
+CELL_BITS = 5
+CELLS = 1 << CELL_BITS
+FIRST_CODE = 16
+CUBE_LEVELS = [0, 95, 135, 175, 215, 255]
+
+
+def palette():
+    colors = []
+    for red in CUBE_LEVELS:
+        for green in CUBE_LEVELS:
+            for blue in CUBE_LEVELS:
+                colors.append((red, green, blue))
+    for gray in range(24):
+        level = 8 + gray * 10
+        colors.append((level, level, level))
+    return colors
+
+
+def linear(channel):
+    channel /= 255.0
+    return channel / 12.92 if channel <= 0.04045 else ((channel + 0.055) / 1.055) ** 2.4
+
+
+def oklab(color):
+    red, green, blue = (linear(channel) for channel in color)
+    l = (0.4122214708 * red + 0.5363325363 * green + 0.0514459929 * blue) ** (1 / 3)
+    m = (0.2119034982 * red + 0.6806995451 * green + 0.1073969566 * blue) ** (1 / 3)
+    s = (0.0883024619 * red + 0.2817188376 * green + 0.6299787005 * blue) ** (1 / 3)
+    return (0.2104542553 * l + 0.7936177850 * m - 0.0040720468 * s,
+            1.9779984951 * l - 2.4285922050 * m + 0.4505937099 * s,
+            0.0259040371 * l + 0.7827717662 * m - 0.8086757660 * s)
+
+
+def nearest(color, candidates):
+    lightness, a, b = oklab(color)
+    best_code = 0
+    best_distance = float('inf')
+    for code, (other_lightness, other_a, other_b) in candidates:
+        distance = (lightness - other_lightness) ** 2 + (a - other_a) ** 2 + (b - other_b) ** 2
+        if distance < best_distance:
+            best_code = code
+            best_distance = distance
+    return best_code
+
+
+def main():
+    candidates = [(FIRST_CODE + index, oklab(color)) for index, color in enumerate(palette())]
+    half_cell = (256 // CELLS) // 2
+
+    out = []
+    out.append('/* Generated by gen_palette_table.py, do not edit. */')
+    out.append('#ifndef PALETTE_TABLE_H')
+    out.append('#define PALETTE_TABLE_H')
+    out.append('')
+    out.append('#include <stdint.h>')
+    out.append('')
+    out.append('#define PALETTE_CELL_BITS (%d)' % CELL_BITS)
+    out.append('#define PALETTE_CELLS (1 << PALETTE_CELL_BITS)')
+    out.append('')
+    out.append('/* Nearest xterm 256-color code, by the top bits of red, green and blue. */')
+    out.append('static const uint8_t palette_nearest[PALETTE_CELLS][PALETTE_CELLS][PALETTE_CELLS] = {')
+    for red in range(CELLS):
+        out.append('    {')
+        for green in range(CELLS):
+            codes = [nearest(((red << (8 - CELL_BITS)) + half_cell, (green << (8 - CELL_BITS)) + half_cell,
+                              (blue << (8 - CELL_BITS)) + half_cell), candidates) for blue in range(CELLS)]
+            out.append('        { ' + ', '.join('%d' % code for code in codes) + ' },')
+        out.append('    },')
+    out.append('};')
+    out.append('')
+    out.append('#endif /* PALETTE_TABLE_H */')
+
+    output = open(sys.argv[1], 'w') if len(sys.argv) > 1 else sys.stdout
+    output.write('\n'.join(out) + '\n')
+
+
+if __name__ == '__main__':
+    main()
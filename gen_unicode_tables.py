@@ -0,0 +1,237 @@
+#!/usr/bin/env python3
+"""Generate unicode_tables.h, the column width and grapheme cluster break class of every code point.
+
+Usage: gen_unicode_tables.py [OUTPUT [UCD_DIRECTORY]]
+
+The data comes from the unicodedata module of the Python running the script. It has no grapheme
+break or emoji properties: they are read from GraphemeBreakProperty.txt and emoji-data.txt when
+UCD_DIRECTORY has them (of the same Unicode version). Without them the classes are approximated
+from the general category and the ranges below, which miss the Indic prepend letters and count
+every Mc as SpacingMark, so clusters of those scripts may split where UAX #29 does not.
+Code points are looked up in two steps: blocks of BLOCK_SIZE code points share a row of the
+second table when their properties are the same.
+"""
+
+import os
+import sys
+import unicodedata
+
+BLOCK_BITS = 7
+BLOCK_SIZE = 1 << BLOCK_BITS
+CODE_POINTS = 0x110000
+
+# Same order as the enum written out below. Control, CR and LF come first, they always break.
+CLASSES = [
+    'CONTROL', 'CR', 'LF', 'OTHER', 'EXTEND', 'ZWJ', 'REGIONAL_INDICATOR', 'PREPEND',
+    'SPACING_MARK', 'L', 'V', 'T', 'LV', 'LVT', 'EXTENDED_PICTOGRAPHIC',
+]
+CLASS = {name: index for index, name in enumerate(CLASSES)}
+
+# Grapheme_Cluster_Break values of GraphemeBreakProperty.txt, the rest is OTHER.
+UCD_CLASSES = {
+    'CR': 'CR', 'LF': 'LF', 'Control': 'CONTROL', 'Extend': 'EXTEND', 'ZWJ': 'ZWJ',
+    'Regional_Indicator': 'REGIONAL_INDICATOR', 'Prepend': 'PREPEND', 'SpacingMark': 'SPACING_MARK',
+    'L': 'L', 'V': 'V', 'T': 'T', 'LV': 'LV', 'LVT': 'LVT',
+}
+
+# Grapheme_Cluster_Break=Prepend, the format characters of it, when approximated.
+PREPEND = [(0x0600, 0x0605), (0x06dd, 0x06dd), (0x070f, 0x070f), (0x0890, 0x0891),
+           (0x08e2, 0x08e2), (0x110bd, 0x110bd), (0x110cd, 0x110cd)]
+
+# Extended_Pictographic, from emoji-data.txt.
+EXTENDED_PICTOGRAPHIC = [
+    (0x00a9, 0x00a9), (0x00ae, 0x00ae), (0x203c, 0x203c), (0x2049, 0x2049), (0x2122, 0x2122),
+    (0x2139, 0x2139), (0x2194, 0x2199), (0x21a9, 0x21aa), (0x231a, 0x231b), (0x2328, 0x2328),
+    (0x2388, 0x2388), (0x23cf, 0x23cf), (0x23e9, 0x23f3), (0x23f8, 0x23fa), (0x24c2, 0x24c2),
+    (0x25aa, 0x25ab), (0x25b6, 0x25b6), (0x25c0, 0x25c0), (0x25fb, 0x25fe), (0x2600, 0x2605),
+    (0x2607, 0x2612), (0x2614, 0x2685), (0x2690, 0x2705), (0x2708, 0x2712), (0x2714, 0x2714),
+    (0x2716, 0x2716), (0x271d, 0x271d), (0x2721, 0x2721), (0x2728, 0x2728), (0x2733, 0x2734),
+    (0x2744, 0x2744), (0x2747, 0x2747), (0x274c, 0x274c), (0x274e, 0x274e), (0x2753, 0x2755),
+    (0x2757, 0x2757), (0x2763, 0x2767), (0x2795, 0x2797), (0x27a1, 0x27a1), (0x27b0, 0x27b0),
+    (0x27bf, 0x27bf), (0x2934, 0x2935), (0x2b05, 0x2b07), (0x2b1b, 0x2b1c), (0x2b50, 0x2b50),
+    (0x2b55, 0x2b55), (0x3030, 0x3030), (0x303d, 0x303d), (0x3297, 0x3297), (0x3299, 0x3299),
+    (0x1f000, 0x1f0ff), (0x1f10d, 0x1f10f), (0x1f12f, 0x1f12f), (0x1f16c, 0x1f171),
+    (0x1f17e, 0x1f17f), (0x1f18e, 0x1f18e), (0x1f191, 0x1f19a), (0x1f1ad, 0x1f1e5),
+    (0x1f201, 0x1f20f), (0x1f21a, 0x1f21a), (0x1f22f, 0x1f22f), (0x1f232, 0x1f23a),
+    (0x1f23c, 0x1f23f), (0x1f249, 0x1f3fa), (0x1f400, 0x1f53d), (0x1f546, 0x1f64f),
+    (0x1f680, 0x1f6ff), (0x1f774, 0x1f77f), (0x1f7d5, 0x1f7ff), (0x1f80c, 0x1f80f),
+    (0x1f848, 0x1f84f), (0x1f85a, 0x1f85f), (0x1f888, 0x1f88f), (0x1f8ae, 0x1f8ff),
+    (0x1f90c, 0x1f93a), (0x1f93c, 0x1f945), (0x1f947, 0x1faff), (0x1fc00, 0x1fffd),
+]
+
+# Whitespace as glibc's iswspace sees it: no-break spaces are not.
+NOT_SPACE = {0x00a0, 0x2007, 0x202f}
+
+
+def range_set(ranges):
+    return {code_point for first, last in ranges for code_point in range(first, last + 1)}
+
+
+PREPEND_SET = range_set(PREPEND)
+EXTENDED_PICTOGRAPHIC_SET = range_set(EXTENDED_PICTOGRAPHIC)
+
+# Classes read from the UCD files, by code point, when there are any.
+ucd_classes = None
+
+
+def find_ucd_file(directory, name):
+    """The file in directory, or in the auxiliary/ and emoji/ directories of a UCD tree."""
+    for subdirectory in ('', 'auxiliary', 'emoji'):
+        path = os.path.join(directory, subdirectory, name)
+        if os.path.isfile(path):
+            return path
+    return None
+
+
+def read_ucd_property(path, values):
+    """Map the code points of the lines of path whose property is in values to its class."""
+    classes = {}
+    with open(path, encoding='utf-8') as ucd_file:
+        for line in ucd_file:
+            fields = line.split('#', 1)[0].split(';')
+            if len(fields) < 2 or fields[1].strip() not in values:
+                continue
+            first, _, last = fields[0].strip().partition('..')
+            for code_point in range(int(first, 16), int(last or first, 16) + 1):
+                classes[code_point] = values[fields[1].strip()]
+    return classes
+
+
+def read_ucd_classes(directory):
+    """The classes of GraphemeBreakProperty.txt and emoji-data.txt, None without both files."""
+    grapheme_path = find_ucd_file(directory, 'GraphemeBreakProperty.txt')
+    emoji_path = find_ucd_file(directory, 'emoji-data.txt')
+    if not grapheme_path or not emoji_path:
+        return None
+    classes = read_ucd_property(emoji_path, {'Extended_Pictographic': 'EXTENDED_PICTOGRAPHIC'})
+    classes.update(read_ucd_property(grapheme_path, UCD_CLASSES))
+    return classes
+
+
+def grapheme_class(code_point, category):
+    if ucd_classes is not None:
+        return ucd_classes.get(code_point, 'OTHER')
+    if code_point == 0x0d:
+        return 'CR'
+    if code_point == 0x0a:
+        return 'LF'
+    if code_point == 0x200d:
+        return 'ZWJ'
+    if code_point in PREPEND_SET:
+        return 'PREPEND'
+    if code_point == 0x200c or 0x1f3fb <= code_point <= 0x1f3ff or 0xe0020 <= code_point <= 0xe007f:
+        return 'EXTEND'
+    if category in ('Cc', 'Zl', 'Zp', 'Cf'):
+        return 'CONTROL'
+    if category in ('Mn', 'Me') or code_point in (0xff9e, 0xff9f):
+        return 'EXTEND'
+    if category == 'Mc':
+        return 'SPACING_MARK'
+    if 0x1f1e6 <= code_point <= 0x1f1ff:
+        return 'REGIONAL_INDICATOR'
+    if 0x1100 <= code_point <= 0x115f or 0xa960 <= code_point <= 0xa97c:
+        return 'L'
+    if 0x1160 <= code_point <= 0x11a7 or 0xd7b0 <= code_point <= 0xd7c6:
+        return 'V'
+    if 0x11a8 <= code_point <= 0x11ff or 0xd7cb <= code_point <= 0xd7fb:
+        return 'T'
+    if 0xac00 <= code_point <= 0xd7a3:
+        return 'LV' if (code_point - 0xac00) % 28 == 0 else 'LVT'
+    if code_point in EXTENDED_PICTOGRAPHIC_SET:
+        return 'EXTENDED_PICTOGRAPHIC'
+    return 'OTHER'
+
+
+def width(code_point, category, klass):
+    if code_point == 0x00ad:
+        return 1
+    if klass in ('CONTROL', 'CR', 'LF', 'EXTEND', 'ZWJ', 'V', 'T'):
+        return 0
+    if klass == 'PREPEND' and category == 'Cf':
+        return 0
+    if category == 'Cn':
+        return 2 if 0x20000 <= code_point <= 0x3fffd else 1
+    if unicodedata.east_asian_width(chr(code_point)) in ('W', 'F'):
+        return 2
+    return 1
+
+
+def properties(code_point):
+    character = chr(code_point)
+    category = unicodedata.category(character)
+    klass = grapheme_class(code_point, category)
+    space = character.isspace() and code_point not in NOT_SPACE
+    return width(code_point, category, klass) | (CLASS[klass] << 2) | (0x40 if space else 0)
+
+
+def format_rows(values, per_line, indent='    '):
+    lines = []
+    for start in range(0, len(values), per_line):
+        lines.append(indent + ', '.join('%d' % value for value in values[start:start + per_line]) + ',')
+    return '\n'.join(lines)
+
+
+def main():
+    global ucd_classes
+    blocks = []
+    block_index = {}
+    stage1 = []
+
+    if len(sys.argv) > 2:
+        ucd_classes = read_ucd_classes(sys.argv[2])
+        if ucd_classes is None:
+            sys.stderr.write('%s: no GraphemeBreakProperty.txt and emoji-data.txt in %s, approximating\n'
+                             % (sys.argv[0], sys.argv[2]))
+    source = 'GraphemeBreakProperty.txt' if ucd_classes is not None else 'approximated grapheme classes'
+
+    for start in range(0, CODE_POINTS, BLOCK_SIZE):
+        block = tuple(properties(code_point) for code_point in range(start, start + BLOCK_SIZE))
+        if block not in block_index:
+            block_index[block] = len(blocks)
+            blocks.append(block)
+        stage1.append(block_index[block])
+
+    stage1_type = 'uint8_t' if len(blocks) <= 0x100 else 'uint16_t'
+    out = []
+    out.append('/* Generated by gen_unicode_tables.py from Unicode %s and %s, do not edit. */'
+               % (unicodedata.unidata_version, source))
+    out.append('#ifndef UNICODE_TABLES_H')
+    out.append('#define UNICODE_TABLES_H')
+    out.append('')
+    out.append('#include <stdint.h>')
+    out.append('')
+    out.append('/* Grapheme cluster break classes, UAX #29. */')
+    out.append('typedef enum grapheme_class_e {')
+    for name in CLASSES:
+        out.append('    GRAPHEME_CLASS_%s,' % name)
+    out.append('    GRAPHEME_CLASS_COUNT')
+    out.append('} grapheme_class_t;')
+    out.append('')
+    out.append('/* Properties byte: column width, grapheme class and whitespace flag. */')
+    out.append('#define UNICODE_PROPERTIES(width, grapheme_class, is_space) ((width) | ((grapheme_class) << 2) | ((is_space) ? 0x40 : 0))')
+    out.append('#define UNICODE_WIDTH(properties) ((properties) & 0x3)')
+    out.append('#define UNICODE_CLASS(properties) ((grapheme_class_t)(((properties) >> 2) & 0xf))')
+    out.append('#define UNICODE_IS_SPACE(properties) ((properties) & 0x40)')
+    out.append('')
+    out.append('#define UNICODE_BLOCK_BITS (%d)' % BLOCK_BITS)
+    out.append('#define UNICODE_BLOCK_SIZE (1 << UNICODE_BLOCK_BITS)')
+    out.append('')
+    out.append('static const %s unicode_blocks[%d] = {' % (stage1_type, len(stage1)))
+    out.append(format_rows(stage1, 16))
+    out.append('};')
+    out.append('')
+    out.append('static const uint8_t unicode_properties[%d][UNICODE_BLOCK_SIZE] = {' % len(blocks))
+    for block in blocks:
+        out.append('    {')
+        out.append(format_rows(block, 16, '        '))
+        out.append('    },')
+    out.append('};')
+    out.append('')
+    out.append('#endif /* UNICODE_TABLES_H */')
+
+    output = open(sys.argv[1], 'w') if len(sys.argv) > 1 else sys.stdout
+    output.write('\n'.join(out) + '\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -1,39 +1,35 @@
-#define _XOPEN_SOURCE
+#define _GNU_SOURCE
 
 /* *** Includes ******************************************************/
 #include <stdbool.h>
-#include <ctype.h>
-#include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <locale.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include <unistd.h>
 #include <wchar.h>
 #include <time.h>
-#include "math.h"
-
-
-/* *** Common ********************************************************/
-/* Constants */
-#define NEWLINE '\n'
-#define ESCAPE_CHAR '\033'
-
-/* Types */
-typedef enum escape_state_e {
-    ESCAPE_STATE_OUT = 0,
-    ESCAPE_STATE_IN,
-    ESCAPE_STATE_LAST
-} escape_state_t;
-
-/* Macros */
-#define UNUSED(var) ((void)(var))
-#define NEXT_CYCLIC_ELEMENT(array, index, array_size) \
-    (((index) + 1 == (array_size)) ? (array)[0] : (array)[((index) + 1)] )
-#define IS_LETTER(c) (('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z'))
+#include "queercat.h"
+#include "queercat_internal.h"
+#include "server.h"
+#include "animate.h"
+#include "cache.h"
+#include "follow.h"
+#include "exec.h"
+#include "uring.h"
 
 
 /* *** Constants *****************************************************/
@@ -43,19 +39,57 @@ static char helpstr[] = "\n"
                         "Concatenate FILE(s), or standard input, to standard output.\n"
                         "With no FILE, or when FILE is -, read standard input.\n"
                         "\n"
-                        "--flag <d>                , -f <d>: Choose colors to use:\n"
+                        "--flag <d>                , -f <d>: Choose colors to use, by number or name:\n"
                         "                                    [rainbow: 0, trans: 1, NB: 2, lesbian: 3,\n"
                         "                                    gay: 4, pan: 5, bi: 6, genderfluid: 7, asexual: 8,\n"
-                        "                                    unlabeled: 9]\n"
+                        "                                    unlabeled: 9] or a flag of the config file\n"
                         "                                    default is rainbow (0)\n"
+                        "              --config <f>, -c <f>: Load flags from <f> (default:\n"
+                        "                                    ~/.config/queercat/flags.conf)\n"
                         "--horizontal-frequency <d>, -h <d>: Horizontal rainbow frequency (default: 0.23)\n"
                         "  --vertical-frequency <d>, -v <d>: Vertical rainbow frequency (default: 0.1)\n"
+                        "           --threshold <d>, -t <d>: Skip 24-bit color changes smaller than <d>\n"
+                        "                                    (redmean distance, 0-765, default: 0)\n"
+                        "                --jobs <d>, -j <d>: Color big inputs, and files side by side, on <d>\n"
+                        "                                    threads (default: 1, at most 1024). With --cache,\n"
+                        "                                    files go through the cache one by one instead\n"
+                        "                    --memory <MiB>: Input colored ahead of the output with -j\n"
+                        "                                    (default: 2 per thread)\n"
+                        "                      --stream, -s: Write out as soon as the input pauses\n"
+                        "                          --follow: Keep writing out what is appended to the\n"
+                        "                                    files, as \"tail -F -n0\" does\n"
+                        "            --exec <cmd> [args...]: Run <cmd> on a terminal and colorize its output,\n"
+                        "                                    exiting with its status\n"
+                        "         --deadline <ms>, -d <ms>: Write out at least every <ms> when streaming\n"
+                        "                                    (default: 5)\n"
                         "                 --force-color, -F: Force color even when stdout is not a tty\n"
                         "             --no-force-locale, -l: Use encoding from system locale instead of\n"
                         "                                    assuming UTF-8\n"
                         "                      --random, -r: Random colors\n"
+                        "                      --offset <d>: Offset of the colors, from 0 to 1 (default:\n"
+                        "                                    from the time of day)\n"
+                        "                     --animate, -a: Animate the colors of the whole input\n"
+                        "                         --fps <d>: Frames per second when animating (default: 20)\n"
+                        "                  --duration <sec>: Animate for <sec> seconds, 0 until interrupted\n"
+                        "                                    (default: 5)\n"
                         "                       --24bit, -b: Output in 24-bit \"true\" RGB mode (slower and\n"
                         "                                    not supported by all terminals)\n"
+                        "                    --quantize, -q: Output the 24-bit gradient in the nearest of the\n"
+                        "                                    256 ANSI colors\n"
+                        "                            --html: Output an HTML <pre> element, colored with\n"
+                        "                                    CSS classes\n"
+                        "                        --io-uring: Read, color and write at the same time with\n"
+                        "                                    io_uring, when the system has it, for the inputs\n"
+                        "                                    -j does not color side by side\n"
+                        "                           --cache: Reuse the colored output of files (not stdin)\n"
+                        "                                    seen before, with the same options and --offset\n"
+                        "                --cache-size <MiB>: Size of the cache (default: 64)\n"
+                        "                         --verbose: Report the coloring kernel on stderr\n"
+                        "                 --server <socket>: Serve colorizing streams on a Unix socket\n"
+                        "                --connect <socket>: Have the server on <socket> colorize the input\n"
+                        "             --stats, --stats=json: Report counters and timings once done, not with\n"
+                        "                                    --exec, --follow, --animate, --server or --connect\n"
+                        "                   --stats-fd <fd>: Write the report to <fd> (default: 2)\n"
                         "                         --version: Print version and exit\n"
                         "                            --help: Show this message\n"
                         "\n"
@@ -69,259 +103,66 @@ static char helpstr[] = "\n"
                         "base for code: <https://github.com/jaseg/lolcat/>\n"
                         "Original idea: <https://github.com/busyloop/lolcat/>\n";
 
-#define MAX_FLAG_STRIPES (6)
-#define MAX_ANSII_CODES_PER_STRIPE (5)
-#define MAX_ANSII_CODES_COUNT (MAX_FLAG_STRIPES * MAX_ANSII_CODES_PER_STRIPE)
-#define MAX_FLAG_NAME_LENGTH (64)
+#define INPUT_BLOCK_SIZE (64 * 1024)
+#define ZERO_COPY_CHUNK_SIZE (1 << 30)
+#define PARALLEL_CHUNK_SIZE (1024 * 1024)
+#define PARALLEL_CHUNKS_PER_JOB (2)
+#define PARALLEL_MIN_LENGTH (2 * PARALLEL_CHUNK_SIZE)
+#define MAX_JOBS (1024)
+#define MAX_PARALLEL_FILES (1024)
+#define STREAM_BATCH_BLOCKS (2)
+#define DEFAULT_STREAM_DEADLINE_MS (5)
+#define DEFAULT_ANIMATION_FPS (20)
+#define DEFAULT_ANIMATION_DURATION (5.0)
+#define CONFIG_FILE_NAME "queercat/flags.conf"
+#define CACHE_FILE_NAME "queercat/flags/%016" PRIx64 ".cache"
+#define RENDER_CACHE_DIRECTORY_NAME "queercat/render"
+#define DEFAULT_RENDER_CACHE_MIB (64)
 
 
 /* *** Types *********************************************************/
-/* Colors. */
-typedef uint32_t hex_color_t;
-typedef unsigned char ansii_code_t;
-typedef struct color_s {
-    uint8_t red;
-    uint8_t green;
-    uint8_t blue;
-} color_t;
-
-/* Color type patterns. */
-typedef enum color_type_e {
-    COLOR_TYPE_INVALID = -1,
-    COLOR_TYPE_ANSII = 0,
-    COLOR_TYPE_24_BIT,
-    COLOR_TYPE_COUNT
-} color_type_t;
-typedef struct ansii_pattern_s {
-    const unsigned int codes_count;
-    const unsigned char ansii_codes[MAX_ANSII_CODES_COUNT];
-} ansii_pattern_t;
-typedef struct color_pattern_s {
-    const uint8_t stripes_count;
-    const uint32_t stripes_colors[MAX_FLAG_STRIPES];
-    const float factor;
-} color_pattern_t;
-
-/* Get color function. */
-typedef void(get_color_f)(const color_pattern_t *color_pattern, float theta, color_t *color);
-
-/* Pattern. */
-typedef struct pattern_s {
-    const char name[MAX_FLAG_NAME_LENGTH];
-    const ansii_pattern_t ansii_pattern;
-    const color_pattern_t color_pattern;
-    get_color_f *get_color;
-} pattern_t;
-
-/* Patterns enum. */
-typedef enum flag_type_e
-{
-    FLAG_TYPE_INVALID = -1,
-    FLAG_TYPE_RAINBOW = 0,
-    FLAG_TYPE_TRANS,
-    FLAG_TYPE_NB,
-    FLAG_TYPE_LESBIAN,
-    FLAG_TYPE_GAY,
-    FLAG_TYPE_PAN,
-    FLAG_TYPE_BI,
-    FLAG_TYPE_GENDERFLUID,
-    FLAG_TYPE_ASEXUAL,
-    FLAG_TYPE_UNLABELED,
-    FLAG_TYPE_END
-} flag_type_t;
-
-
-/* *** Pattern Functions *********************************************/
-get_color_f get_color_rainbow;
-get_color_f get_color_stripes;
-
-
-/* *** Flags *********************************************************/
-const pattern_t rainbow = {
-    .name = "rainbow",
-    .ansii_pattern = {
-        .codes_count = 30,
-        .ansii_codes = { 39, 38, 44, 43, 49, 48, 84, 83, 119, 118, 154, 148, 184, 178,
-        214, 208, 209, 203, 204, 198, 199, 163, 164, 128, 129, 93, 99, 63, 69, 33 }
-    },
-    .color_pattern = { 0 },
-    .get_color = get_color_rainbow
-};
-
-const pattern_t transgender = {
-    .name = "transgender",
-    .ansii_pattern = {
-        .codes_count = 10,
-        .ansii_codes = {117, 117,  225, 225,  255, 255,  225, 225,  117, 117}
-    },
-    .color_pattern = {
-        .stripes_count = 5,
-        .stripes_colors = {
-            0x55cdfc, /* #55cdfd - Blue */
-            0xf7a8b8, /* #f7a8b8 - Pink */
-            0xffffff, /* #ffffff - White */
-            0xf7a8b8, /* #f7a8b8 - Pink */
-            0x55cdfc  /* #55cdfc - Blue */
-        },
-        .factor = 4.0f
-    },
-    .get_color = get_color_stripes
-};
-
-const pattern_t nonbinary = {
-    .name = "nonbinary",
-    .ansii_pattern = {
-        .codes_count = 8,
-        .ansii_codes = {226, 226, 255, 255, 93, 93, 234, 234}
-    },
-    .color_pattern = {
-        .stripes_count = 4,
-        .stripes_colors = {
-            0xffff00, /* #ffff00 - Yellow */
-            0xb000ff, /* #b000ff - Purple */
-            0xffffff, /* #ffffff - White */
-            0x000000  /* #000000 - Black */
-        },
-        .factor = 4.0f
-    },
-    .get_color = get_color_stripes
-};
-
-const pattern_t lesbian = {
-    .name = "lesbian",
-    .ansii_pattern = {
-        .codes_count = 5,
-        .ansii_codes = {196, 208, 255, 170, 128}
-    },
-    .color_pattern = {
-        .stripes_count = 5,
-        .stripes_colors = {
-            0xff0000, /* #ff0000 - Red */
-            0xff993f, /* #ff993f - Orange */
-            0xffffff, /* #ffffff - White */
-            0xff8cbd, /* #ff8cbd - Pink */
-            0xff4284  /* #ff4284 - Purple */
-        },
-        .factor = 2.0f
-    },
-    .get_color = get_color_stripes
-};
-
-const pattern_t gay = {
-    .name = "gay",
-    .ansii_pattern = {
-        .codes_count = 7,
-        .ansii_codes = {36, 49, 121, 255, 117, 105, 92}
-    },
-    .color_pattern = {
-        .stripes_count = 5,
-        .stripes_colors = {
-            0x00b685, /* #00b685 - Teal */
-            0x6bffb6, /* #6bffb6 - Green */
-            0xffffff, /* #ffffff - White */
-            0x8be1ff, /* #8be1ff - Blue */
-            0x8e1ae1  /* #8e1ae1 - Purple */
-        },
-        .factor = 6.0f
-    },
-    .get_color = get_color_stripes
-};
-
-const pattern_t pansexual = {
-    .name = "pansexual",
-    .ansii_pattern = {
-        .codes_count = 9,
-        .ansii_codes = {200, 200, 200,  227, 227, 227,  45, 45, 45}
-    },
-    .color_pattern = {
-        .stripes_count = 3,
-        .stripes_colors = {
-            0xff3388, /* #ff3388 - Pink */
-            0xffea00, /* #ffea00 - Yellow */
-            0x00dbff  /* #00dbff - Cyan */
-        },
-        .factor = 8.0f
-    },
-    .get_color = get_color_stripes
-};
-
-const pattern_t bisexual = {
-    .name = "bisexual",
-    .ansii_pattern = {
-        .codes_count = 8,
-        .ansii_codes = {162, 162, 162,  129, 129, 27, 27, 27}
-    },
-    .color_pattern = {
-        .stripes_count = 5,
-        .stripes_colors = {
-            0xff3b7b, /* #ff3b7b - Pink */
-            0xff3b7b, /* #ff3b7b - Pink */
-            0xd06bcc, /* #d06bcc - Purple */
-            0x3b72ff, /* #3b72ff - Blue */
-            0x3b72ff  /* #3b72ff - Blue */
-        },
-        .factor = 4.0f
-    },
-    .get_color = get_color_stripes
-};
-
-const pattern_t gender_fluid = {
-    .name = "gender_fluid",
-    .ansii_pattern = {
-        .codes_count = 10,
-        .ansii_codes = {219, 219, 255, 255, 128, 128, 234, 234, 20, 20}
-    },
-    .color_pattern = {
-        .stripes_count = 5,
-        .stripes_colors = {
-            0xffa0bc, /* #ffa0bc - Pink */
-            0xffffff, /* #ffffff - White */
-            0xc600e4, /* #c600e4 - Purple */
-            0x000000, /* #000000 - Black */
-            0x4e3cbb  /* #4e3cbb - Blue */
-        },
-        .factor = 2.0f
-    },
-    .get_color = get_color_stripes
-};
-
-const pattern_t asexual = {
-    .name = "asexual",
-    .ansii_pattern = {
-        .codes_count = 8,
-        .ansii_codes = {233, 233, 247, 247, 255, 255, 5, 5}
-    },
-    .color_pattern = {
-        .stripes_count = 4,
-        .stripes_colors = {
-            0x000000, /* #000000 - Black */
-            0xa3a3a3, /* #a3a3a3 - Gray */
-            0xffffff, /* #ffffff - White */
-            0x800080  /* #800080 - Purple */
-        },
-        .factor = 4.0f
-    },
-    .get_color = get_color_stripes
-};
-
-const pattern_t unlabeled = {
-    .name = "unlabeled",
-    .ansii_pattern = {
-        .codes_count = 8,
-        .ansii_codes = {194, 194, 255, 255, 195, 195, 223, 223}
-    },
-    .color_pattern = {
-        .stripes_count = 4,
-        .stripes_colors = {
-            0xe6f9e3, /* #e6f9e3 - Green */
-            0xfdfdfb, /* #fdfdfb - White */
-            0xdeeff9, /* #deeff9 - Blue */
-            0xfae1c2  /* #fae1c2 - Orange */
-        },
-        .factor = 4.0f
-    },
-    .get_color = get_color_stripes
-};
+/* Report of a run for --stats, over all of its inputs. */
+typedef enum stats_format_e {
+    STATS_FORMAT_NONE = 0,
+    STATS_FORMAT_TEXT,
+    STATS_FORMAT_JSON
+} stats_format_t;
+typedef struct run_stats_s {
+    stage_stats_t read;
+    stage_stats_t write;
+    uint64_t start_wall_ns;
+    uint64_t start_cpu_ns;
+} run_stats_t;
+
+/* Input colored in parallel, a mapped file or all of stdin. */
+typedef struct parallel_input_s {
+    const uint8_t *data;
+    size_t length;
+} parallel_input_t;
+
+/* Part of an input colored by a worker thread, starting right after a newline or at the start
+ * of an input. */
+typedef struct chunk_s {
+    const uint8_t *data;
+    size_t length;
+    uint64_t start_line_index;
+    bool final;                  /* Last chunk of its input. */
+    bool done;
+    colorizer_t colorizer;
+    output_buffer_t output;
+} chunk_t;
+
+/* Chunks of one input, shared by the worker threads and the writer. */
+typedef struct parallel_job_s {
+    pthread_mutex_t mutex;
+    pthread_cond_t chunk_done;
+    pthread_cond_t chunk_written;
+    chunk_t *chunks;
+    size_t chunks_count;
+    size_t next_chunk;
+    size_t in_flight_bytes;      /* Input of the chunks started and not written yet. */
+    size_t max_in_flight_bytes;
+} parallel_job_t;
 
 
 /* *** Functions Declarations ****************************************/
@@ -329,14 +170,52 @@ const pattern_t unlabeled = {
 static void usage(void);
 static void version(void);
 
-/* Helpers */
-static void find_escape_sequences(wint_t current_char, escape_state_t *state);
-static wint_t helpstr_hack(FILE * _ignored);
+/* Flags */
+static char *user_file_path(const char *xdg_variable, const char *home_directory, const char *file_name);
+static void make_parent_directories(const char *path);
+static char *flag_cache_path(const char *config_path);
+static queercat_registry_t *load_registry(const char *config_path);
+
+/* Stats */
+static ssize_t timed_read(int fd, void *buffer, size_t length);
+static void add_stats(queercat_stats_t *total, const queercat_stats_t *stats);
+static void print_stats(int fd, stats_format_t format, const queercat_stats_t *stats);
+
+/* Input */
+static void feed_stream(queercat_stream_t *stream, output_buffer_t *output, const uint8_t *input, size_t length);
+static void flush_stream(queercat_stream_t *stream, output_buffer_t *output);
+static int colorize_fd(queercat_stream_t *stream, output_buffer_t *output, int fd);
+static bool colorize_mapped_file(queercat_stream_t *stream, output_buffer_t *output, int fd);
+
+/* Streaming */
+static void flush_batch(queercat_stream_t *stream, output_buffer_t *batch);
+static int colorize_fd_streaming(queercat_stream_t *stream, int fd, int deadline_ms);
+
+/* Parallel coloring */
+static void *parallel_worker(void *arg);
+static void write_chunk(colorizer_t *colorizer, chunk_t *chunk, bool first);
+static void colorize_parallel(queercat_stream_t *stream, output_buffer_t *output, const parallel_input_t *inputs, size_t inputs_count,
+                              int jobs, size_t memory_budget);
+static void colorize_window(queercat_stream_t *stream, output_buffer_t *output, output_buffer_t *window, int jobs,
+                            size_t memory_budget, bool whole);
+static int colorize_stdin_parallel(queercat_stream_t *stream, output_buffer_t *output, int jobs, size_t memory_budget);
+static size_t colorize_files_parallel(queercat_stream_t *stream, output_buffer_t *output, char **filenames, size_t filenames_count,
+                                      int jobs, size_t memory_budget);
+
+/* Animation */
+static int animate_inputs(queercat_stream_t *stream, char **inputs, char **inputs_end, int fps, double duration);
+
+/* Passthrough */
+static bool is_zero_copy_fallback_error(int error);
+static int copy_fd(int in_fd, int out_fd, uint64_t *copied);
+
+/* *** Globals *******************************************************/
+/* Only set with --stats, nothing is timed without it. */
+static run_stats_t *run_stats;
+
+/* Only set with --cache. */
+static render_cache_t *render_cache;
 
-/* Colors handling */
-static const pattern_t *get_pattern(flag_type_t flag_type);
-static void mix_colors(uint32_t color1, uint32_t color2, float balance, float factor, color_t *output_color);
-static void print_color(const pattern_t *pattern, color_type_t color_type, int char_index, int line_index, double freq_h, double freq_v, double offx, int rand_offset, int cc);
 
 /* *** Functions *****************************************************/
 static void usage(void)
@@ -351,184 +230,801 @@ static void version(void)
     exit(0);
 }
 
-static void find_escape_sequences(wint_t current_char, escape_state_t *state)
+static char *user_file_path(const char *xdg_variable, const char *home_directory, const char *file_name)
 {
-    if (current_char == '\033') {
-        *state = ESCAPE_STATE_IN;
-    } else if (*state == ESCAPE_STATE_IN) {
-        *state = IS_LETTER(current_char) ? ESCAPE_STATE_LAST : ESCAPE_STATE_IN;
+    const char *base = getenv(xdg_variable);
+    const char *home = getenv("HOME");
+    char *path;
+
+    /* $XDG_..._HOME/file_name, or ~/home_directory/file_name when it is not set. */
+    if (base && *base) {
+        if (asprintf(&path, "%s/%s", base, file_name) < 0)
+            return NULL;
+    } else if (home && *home) {
+        if (asprintf(&path, "%s/%s/%s", home, home_directory, file_name) < 0)
+            return NULL;
     } else {
-        *state = ESCAPE_STATE_OUT;
+        return NULL;
     }
+    return path;
 }
 
-static wint_t helpstr_hack(FILE * _ignored)
+static void make_parent_directories(const char *path)
 {
-    (void)_ignored;
-    static size_t idx = 0;
-    char c = helpstr[idx++];
-    if (c)
-        return c;
-    idx = 0;
-    return WEOF;
+    char *directory = strdup(path);
+
+    if (!directory)
+        return;
+    for (char *slash = strchr(directory + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(directory, 0700);
+        *slash = '/';
+    }
+    free(directory);
 }
 
-static const pattern_t *get_pattern(flag_type_t flag_type)
+static char *flag_cache_path(const char *config_path)
 {
-    switch (flag_type) {
-        case FLAG_TYPE_RAINBOW:
-            return &rainbow;
+    char *absolute_path = realpath(config_path, NULL);
+    const char *key = absolute_path ? absolute_path : config_path;
+    char file_name[sizeof(CACHE_FILE_NAME) + 16];
+    uint64_t hash = 0xcbf29ce484222325;
+
+    /* A cache per config file, named by the FNV-1a hash of its path, so configs used in turn do
+     * not replace each other's. */
+    for (const char *c = key; *c; c++) {
+        hash ^= (uint8_t)*c;
+        hash *= 0x100000001b3;
+    }
+    snprintf(file_name, sizeof(file_name), CACHE_FILE_NAME, hash);
+    free(absolute_path);
 
-        case FLAG_TYPE_TRANS:
-            return &transgender;
+    return user_file_path("XDG_CACHE_HOME", ".cache", file_name);
+}
 
-        case FLAG_TYPE_NB:
-            return &nonbinary;
+static queercat_registry_t *load_registry(const char *config_path)
+{
+    queercat_registry_t *registry = queercat_registry_new();
+    char *default_config_path = NULL;
+    char *cache_path;
+    int error_line = 0;
+
+    if (!registry) {
+        fprintf(stderr, "Cannot create the flags registry: %s\n", strerror(errno));
+        exit(2);
+    }
 
-        case FLAG_TYPE_LESBIAN:
-            return &lesbian;
+    /* Without --config, the default config file is optional. */
+    if (!config_path) {
+        default_config_path = user_file_path("XDG_CONFIG_HOME", ".config", CONFIG_FILE_NAME);
+        if (!default_config_path || access(default_config_path, F_OK)) {
+            free(default_config_path);
+            return registry;
+        }
+        config_path = default_config_path;
+    }
 
-        case FLAG_TYPE_GAY:
-            return &gay;
+    cache_path = flag_cache_path(config_path);
+    if (cache_path)
+        make_parent_directories(cache_path);
+    if (queercat_registry_load(registry, config_path, cache_path, &error_line)) {
+        if (errno == EINVAL && error_line)
+            fprintf(stderr, "Invalid config file \"%s\", line %d\n", config_path, error_line);
+        else
+            fprintf(stderr, "Cannot load config file \"%s\": %s\n", config_path, strerror(errno));
+        exit(2);
+    }
 
-        case FLAG_TYPE_PAN:
-            return &pansexual;
+    free(default_config_path);
+    free(cache_path);
+    return registry;
+}
 
-        case FLAG_TYPE_BI:
-            return &bisexual;
+static ssize_t timed_read(int fd, void *buffer, size_t length)
+{
+    stage_clock_t clock;
+    ssize_t result;
+
+    if (!run_stats)
+        return read(fd, buffer, length);
+    stage_begin(&clock);
+    result = read(fd, buffer, length);
+    stage_end(&run_stats->read, &clock, (result > 0) ? result : 0);
+    return result;
+}
 
-        case FLAG_TYPE_GENDERFLUID:
-            return &gender_fluid;
+static void add_stats(queercat_stats_t *total, const queercat_stats_t *stats)
+{
+    total->chars += stats->chars;
+    total->invalid_bytes += stats->invalid_bytes;
+    total->escape_bytes += stats->escape_bytes;
+    total->colors_emitted += stats->colors_emitted;
+    total->colors_suppressed += stats->colors_suppressed;
+    total->escape_sequences += stats->escape_sequences;
+}
 
-        case FLAG_TYPE_ASEXUAL:
-            return &asexual;
+static void print_stats(int fd, stats_format_t format, const queercat_stats_t *stats)
+{
+    uint64_t total_wall_ns = clock_ns(CLOCK_MONOTONIC) - run_stats->start_wall_ns;
+    uint64_t total_cpu_ns = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - run_stats->start_cpu_ns;
+    const stage_stats_t *read_stage = &run_stats->read;
+    const stage_stats_t *write_stage = &run_stats->write;
+
+    /* Decoding and coloring are whatever time reading and writing did not take, worker threads
+     * included. */
+    stage_stats_t color_stage = {
+        .wall_ns = total_wall_ns - read_stage->wall_ns - write_stage->wall_ns,
+        .cpu_ns = total_cpu_ns - read_stage->cpu_ns - write_stage->cpu_ns
+    };
+    if (total_wall_ns < read_stage->wall_ns + write_stage->wall_ns)
+        color_stage.wall_ns = 0;
+    if (total_cpu_ns < read_stage->cpu_ns + write_stage->cpu_ns)
+        color_stage.cpu_ns = 0;
+
+    if (format == STATS_FORMAT_JSON) {
+        dprintf(fd, "{\"bytes_read\": %" PRIu64 ", \"chars\": %" PRIu64 ", \"invalid_bytes\": %" PRIu64 ", "
+                "\"bytes_written\": %" PRIu64 ", \"escape_bytes\": %" PRIu64 ", "
+                "\"colors_emitted\": %" PRIu64 ", \"colors_suppressed\": %" PRIu64 ", \"escape_sequences\": %" PRIu64 ", "
+                "\"wall_ms\": {\"read\": %.3f, \"decode+color\": %.3f, \"write\": %.3f, \"total\": %.3f}, "
+                "\"cpu_ms\": {\"read\": %.3f, \"decode+color\": %.3f, \"write\": %.3f, \"total\": %.3f}}\n",
+                read_stage->bytes, stats->chars, stats->invalid_bytes, write_stage->bytes, stats->escape_bytes,
+                stats->colors_emitted, stats->colors_suppressed, stats->escape_sequences,
+                read_stage->wall_ns / 1e6, color_stage.wall_ns / 1e6, write_stage->wall_ns / 1e6, total_wall_ns / 1e6,
+                read_stage->cpu_ns / 1e6, color_stage.cpu_ns / 1e6, write_stage->cpu_ns / 1e6, total_cpu_ns / 1e6);
+        return;
+    }
 
-        case FLAG_TYPE_UNLABELED:
-            return &unlabeled;
+    dprintf(fd, "Read:    %" PRIu64 " bytes, %" PRIu64 " chars, %" PRIu64 " invalid UTF-8 bytes\n",
+            read_stage->bytes, stats->chars, stats->invalid_bytes);
+    dprintf(fd, "Written: %" PRIu64 " bytes, %" PRIu64 " of them escapes\n", write_stage->bytes, stats->escape_bytes);
+    dprintf(fd, "Colors:  %" PRIu64 " emitted, %" PRIu64 " suppressed\n", stats->colors_emitted, stats->colors_suppressed);
+    dprintf(fd, "Escape sequences passed through: %" PRIu64 "\n", stats->escape_sequences);
+    dprintf(fd, "Time (wall/cpu ms): read %.3f/%.3f, decode+color %.3f/%.3f, write %.3f/%.3f, total %.3f/%.3f\n",
+            read_stage->wall_ns / 1e6, read_stage->cpu_ns / 1e6, color_stage.wall_ns / 1e6, color_stage.cpu_ns / 1e6,
+            write_stage->wall_ns / 1e6, write_stage->cpu_ns / 1e6, total_wall_ns / 1e6, total_cpu_ns / 1e6);
+}
 
-        default:
-            return NULL;
+static void feed_stream(queercat_stream_t *stream, output_buffer_t *output, const uint8_t *input, size_t length)
+{
+    /* The output buffer holds what one block can turn into. */
+    for (size_t position = 0; position < length; position += INPUT_BLOCK_SIZE) {
+        size_t block_length = (length - position < INPUT_BLOCK_SIZE) ? length - position : INPUT_BLOCK_SIZE;
+        output->length = queercat_stream_feed(stream, input + position, block_length, output->data, output->capacity, NULL);
+        output_flush(output);
     }
 }
 
-static void mix_colors(uint32_t color1, uint32_t color2, float balance, float factor, color_t *output_color)
+static void flush_stream(queercat_stream_t *stream, output_buffer_t *output)
 {
-    uint8_t red_1   = (color1 & 0xff0000) >> 16;
-    uint8_t green_1 = (color1 & 0x00ff00) >>  8;
-    uint8_t blue_1  = (color1 & 0x0000ff) >>  0;
+    output->length = queercat_stream_flush(stream, output->data, output->capacity);
+    output_flush(output);
+}
 
-    uint8_t red_2   = (color2 & 0xff0000) >> 16;
-    uint8_t green_2 = (color2 & 0x00ff00) >>  8;
-    uint8_t blue_2  = (color2 & 0x0000ff) >>  0;
+static int colorize_fd(queercat_stream_t *stream, output_buffer_t *output, int fd)
+{
+    static uint8_t block[INPUT_BLOCK_SIZE];
+    ssize_t result;
+
+    /* Read big blocks, the stream carries a partial UTF-8 sequence over to the next one. */
+    while ((result = timed_read(fd, block, sizeof(block))) != 0) {
+        if (result < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
 
-    balance = pow(balance, factor);
+        /* Flush once per block so interactive input is not held back. */
+        feed_stream(stream, output, block, result);
+    }
 
-    output_color->red = lrintf(red_1 * balance + red_2 * (1.0f - balance));
-    output_color->green = lrintf(green_1 * balance + green_2 * (1.0f - balance));
-    output_color->blue = lrintf(blue_1 * balance + blue_2 * (1.0f - balance));
+    return 0;
 }
 
-void get_color_rainbow (const color_pattern_t *color_pattern, float theta, color_t *color)
+static bool colorize_mapped_file(queercat_stream_t *stream, output_buffer_t *output, int fd)
 {
-    /* Unused variables. */
-    UNUSED(color_pattern);
+    struct stat st;
+    void *mapping;
+
+    /* Regular files are mapped whole and colored in one go, anything else is read. */
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size <= 0)
+        return false;
 
-    /* Get theta in range. */
-    while (theta < 0) theta += 2.0f * (float)M_PI;
-    while (theta >= 2.0f * (float)M_PI) theta -= 2.0f * (float)M_PI;
+    mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED)
+        return false;
+    madvise(mapping, st.st_size, MADV_SEQUENTIAL);
 
-    /* Generate the color. */
-    color->red   = lrintf((1.0f * (0.5f + 0.5f * sin(theta + 0            ))) * 255.0f);
-    color->green = lrintf((1.0f * (0.5f + 0.5f * sin(theta + 2 * M_PI / 3 ))) * 255.0f);
-    color->blue  = lrintf((1.0f * (0.5f + 0.5f * sin(theta + 4 * M_PI / 3 ))) * 255.0f);
+    /* The pages are read in as they are colored, only the size counts as reading. */
+    if (run_stats)
+        run_stats->read.bytes += st.st_size;
+
+    if (!render_cache || !render_cache_colorize(render_cache, stream, output, mapping, st.st_size))
+        feed_stream(stream, output, mapping, st.st_size);
+
+    munmap(mapping, st.st_size);
+    return true;
+}
+
+static void flush_batch(queercat_stream_t *stream, output_buffer_t *batch)
+{
+    size_t pending = queercat_stream_pending_escape(stream);
+    size_t length = (batch->length > pending) ? batch->length - pending : 0;
+
+    /* Hold back an unfinished escape sequence, unless it leaves no room for the next block. */
+    if (batch->capacity - batch->length + length < queercat_output_bound(INPUT_BLOCK_SIZE))
+        length = batch->length;
+
+    output_write(batch, batch->data, length);
+    batch->length -= length;
+    memmove(batch->data, batch->data + length, batch->length);
 }
 
-void get_color_stripes (const color_pattern_t *color_pattern, float theta, color_t *color)
+static int colorize_fd_streaming(queercat_stream_t *stream, int fd, int deadline_ms)
 {
-    /* Get theta in range. */
-    while (theta < 0) theta += 2.0f * (float)M_PI;
-    while (theta >= 2.0f * (float)M_PI) theta -= 2.0f * (float)M_PI;
-
-    /* Find the stripe based on theta and generate the color. */
-    for (int i = 0; i < color_pattern->stripes_count; i++) {
-        float stripe_size = (2.0f * M_PI) / color_pattern->stripes_count;
-        float min_theta = i * stripe_size;
-        float max_theta = (i + 1) * stripe_size;
-
-        if (min_theta <= theta && max_theta > theta) {
-            float balance = 1 - ((theta - min_theta) / stripe_size);
-            mix_colors(
-                    color_pattern->stripes_colors[i],
-                    NEXT_CYCLIC_ELEMENT(color_pattern->stripes_colors, i, color_pattern->stripes_count),
-                    balance,
-                    color_pattern->factor,
-                    color);
-            return;
+    static uint8_t block[INPUT_BLOCK_SIZE];
+    struct pollfd input = { .fd = fd, .events = POLLIN };
+    output_buffer_t batch = {
+        .fd = STDOUT_FILENO,
+        .capacity = STREAM_BATCH_BLOCKS * queercat_output_bound(INPUT_BLOCK_SIZE),
+        .stats = run_stats ? &run_stats->write : NULL
+    };
+    struct timespec batch_start = { 0 };
+    struct timespec now;
+    ssize_t result;
+    int ready;
+    int error;
+
+    batch.data = malloc(batch.capacity);
+    if (!batch.data) {
+        fwprintf(stderr, L"Out of memory\n");
+        exit(2);
+    }
+
+    for (;;) {
+        bool waiting = batch.length > queercat_stream_pending_escape(stream);
+
+        /* With output waiting only check for more input, without it block until there is some. */
+        result = poll(&input, 1, waiting ? 0 : -1);
+        if (result < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (result == 0) {
+            /* The input went idle, show what it sent. */
+            flush_batch(stream, &batch);
+            continue;
+        }
+
+        /* Only poll waits: after POLLIN, read no more than is there, or a read of a whole block could
+         * wait for the rest of it. The fd stays blocking, its flags are shared with the shell. With
+         * nothing there, the read gets the end of the input. */
+        if (ioctl(fd, FIONREAD, &ready) || ready <= 0 || (size_t)ready > sizeof(block))
+            ready = sizeof(block);
+        result = timed_read(fd, block, ready);
+        if (result <= 0) {
+            if (result < 0 && errno == EINTR)
+                continue;
+            break;
         }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (!waiting)
+            batch_start = now;
+        batch.length += queercat_stream_feed(stream, block, result, batch.data + batch.length, batch.capacity - batch.length, NULL);
+
+        /* Input that keeps coming is batched, but not for longer than the deadline. */
+        if ((now.tv_sec - batch_start.tv_sec) * 1000 + (now.tv_nsec - batch_start.tv_nsec) / 1000000 >= deadline_ms
+                || batch.capacity - batch.length < queercat_output_bound(INPUT_BLOCK_SIZE))
+            flush_batch(stream, &batch);
     }
+
+    /* The input is over, nothing more can complete an escape sequence. */
+    error = errno;
+    output_write(&batch, batch.data, batch.length);
+    free(batch.data);
+    errno = error;
+
+    return (result < 0) ? -1 : 0;
 }
 
-static void print_color(const pattern_t *pattern, color_type_t color_type, int char_index, int line_index, double freq_h, double freq_v, double offx, int rand_offset, int cc)
+static void *parallel_worker(void *arg)
 {
-    float theta;
-    color_t color = { 0 };
+    parallel_job_t *job = arg;
 
-    int ncc;
+    pthread_mutex_lock(&job->mutex);
+    while (job->next_chunk < job->chunks_count) {
+        chunk_t *chunk = &job->chunks[job->next_chunk];
 
-    switch (color_type) {
-        case COLOR_TYPE_24_BIT:
-            theta = char_index * freq_h / 5.0f + line_index * freq_v + (offx + 2.0f * rand_offset / (float)RAND_MAX) * M_PI;
+        /* Do not run too far ahead of the writer, but always keep one chunk going. */
+        if (job->in_flight_bytes && job->in_flight_bytes + chunk->length > job->max_in_flight_bytes) {
+            pthread_cond_wait(&job->chunk_written, &job->mutex);
+            continue;
+        }
+        job->in_flight_bytes += chunk->length;
+        job->next_chunk++;
+        pthread_mutex_unlock(&job->mutex);
+
+        colorize_block(&chunk->colorizer, chunk->data, chunk->length, chunk->final);
+
+        pthread_mutex_lock(&job->mutex);
+        chunk->done = true;
+        pthread_cond_broadcast(&job->chunk_done);
+    }
+    pthread_mutex_unlock(&job->mutex);
+
+    return NULL;
+}
+
+static void write_chunk(colorizer_t *colorizer, chunk_t *chunk, bool first)
+{
+    colorizer_t *result = &chunk->colorizer;
+    size_t skip_offset = 0;
+    size_t skip_length = 0;
+    bool recolor = false;
+
+    /* The first chunk starts from the real state. The others were colored assuming a line start,
+     * outside of escapes, with an unknown color on screen: fix them up for the state the previous
+     * chunk actually ended in. */
+    if (!first) {
+        if (colorizer->line_index != chunk->start_line_index || colorizer->phase != colorizer->line_phase
+                || IS_IN_ESCAPE(colorizer->escape_state)) {
+            recolor = true;
+        } else if (colorizer->emitter.valid && !result->first_escape_pending) {
+            emitter_t first_emitter = result->first_emitter;
+            bool same = (colorizer->color_type != COLOR_TYPE_24_BIT) ? first_emitter.code == colorizer->emitter.code
+                        : !memcmp(&first_emitter.color, &colorizer->emitter.color, sizeof(color_t));
+
+            if (same) {
+                /* The first escape would have been skipped. */
+                skip_offset = result->first_escape_offset;
+                skip_length = result->first_escape_length;
+            } else if (colorizer->color_type == COLOR_TYPE_24_BIT && colorizer->threshold_squared > 0
+                       && color_distance_squared(&first_emitter.color, &colorizer->emitter.color) <= colorizer->threshold_squared) {
+                /* The first change would have been dropped, and every later one compared with the old color. */
+                recolor = true;
+            }
+        }
+    }
 
-            pattern->get_color(&pattern->color_pattern, theta, &color);
-            wprintf(L"\033[38;2;%d;%d;%dm", color.red, color.green, color.blue);
+    if (recolor) {
+        colorize_block(colorizer, chunk->data, chunk->length, chunk->final);
+        return;
+    }
+
+    add_stats(&colorizer->stats, &result->stats);
+    if (skip_length) {
+        colorizer->stats.colors_emitted--;
+        colorizer->stats.colors_suppressed++;
+        colorizer->stats.escape_bytes -= skip_length;
+    }
+
+    output_append(colorizer->output, chunk->output.data, skip_length ? skip_offset : chunk->output.length);
+    if (skip_length)
+        output_append(colorizer->output, chunk->output.data + skip_offset + skip_length,
+                      chunk->output.length - skip_offset - skip_length);
+
+    /* Take over the chunk's final state, keeping our color if it never sent or lost one. */
+    colorizer->line_index = result->line_index;
+    colorizer->line_phase = result->line_phase;
+    colorizer->phase = result->phase;
+    colorizer->escape_state = result->escape_state;
+    colorizer->escape_length = result->escape_length;
+    colorizer->grapheme = result->grapheme;
+    if (first || !result->first_escape_pending)
+        colorizer->emitter = result->emitter;
+}
+
+static void colorize_parallel(queercat_stream_t *stream, output_buffer_t *output, const parallel_input_t *inputs, size_t inputs_count,
+                              int jobs, size_t memory_budget)
+{
+    colorizer_t *colorizer = &stream->colorizer;
+    parallel_job_t job = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .chunk_done = PTHREAD_COND_INITIALIZER,
+        .chunk_written = PTHREAD_COND_INITIALIZER,
+        .max_in_flight_bytes = memory_budget
+    };
+    pthread_t *threads;
+    size_t chunks_end[inputs_count];
+    size_t capacity = 0;
+    uint64_t line_index = colorizer->line_index;
+    uint32_t line_phase = colorizer->line_phase;
+
+    for (size_t i = 0; i < inputs_count; i++)
+        capacity += inputs[i].length / PARALLEL_CHUNK_SIZE + 1;
+
+    /* Write the chunks straight to our output, not to the caller's buffers of the stream. The
+     * stylesheet of HTML output goes first, and not once per chunk. */
+    colorizer->output = output;
+    if (colorizer->html_style_pending)
+        write_html_style(colorizer);
+
+    job.chunks = calloc(capacity, sizeof(chunk_t));
+    threads = calloc(jobs, sizeof(pthread_t));
+    if (!job.chunks || !threads) {
+        fwprintf(stderr, L"Out of memory\n");
+        exit(2);
+    }
+
+    /* Cut the inputs right after newlines, counting them for the starting line of each chunk. Each
+     * input starts a chunk, after a flush that leaves no color or escape going. */
+    for (size_t i = 0; i < inputs_count; i++) {
+        const uint8_t *data = inputs[i].data;
+        size_t length = inputs[i].length;
+
+        for (size_t start = 0; start < length; ) {
+            size_t end = start + PARALLEL_CHUNK_SIZE;
+            const uint8_t *newline;
+            chunk_t *chunk = &job.chunks[job.chunks_count++];
+
+            if (end >= length) {
+                end = length;
+            } else if ((newline = memchr(data + end, '\n', length - end))) {
+                end = newline - data + 1;
+            } else {
+                end = length;
+            }
+
+            chunk->data = data + start;
+            chunk->length = end - start;
+            chunk->final = end == length;
+            chunk->output.fd = OUTPUT_GROWABLE;
+            chunk->colorizer = *colorizer;
+            chunk->colorizer.output = &chunk->output;
+            chunk->colorizer.stats = (queercat_stats_t){ 0 };
+            chunk->start_line_index = line_index;
+            if (job.chunks_count > 1) {
+                chunk->colorizer.line_index = line_index;
+                chunk->colorizer.first_escape_pending = true;
+                chunk->colorizer.line_phase = line_phase;
+                chunk->colorizer.phase = line_phase;
+                chunk->colorizer.escape_state = ESCAPE_STATE_OUT;
+                chunk->colorizer.emitter.valid = false;
+            }
+
+            for (const uint8_t *p = chunk->data; (p = memchr(p, '\n', data + end - p)); p++) {
+                line_index++;
+                line_phase += colorizer->line_step;
+            }
+            start = end;
+        }
+        chunks_end[i] = job.chunks_count;
+    }
+
+    /* No more threads than chunks to color. */
+    if ((size_t)jobs > job.chunks_count)
+        jobs = job.chunks_count;
+    output_flush(colorizer->output);
+    for (int i = 0; i < jobs; i++) {
+        if (pthread_create(&threads[i], NULL, parallel_worker, &job)) {
+            fwprintf(stderr, L"Cannot start worker thread\n");
+            exit(2);
+        }
+    }
+
+    /* Write the chunks in order as they are done, ending each input as the serial loop does. */
+    for (size_t input = 0, i = 0; input < inputs_count; input++) {
+        if (input > 0) {
+            colorizer->output = &stream->output;
+            flush_stream(stream, output);
+            colorizer->output = output;
+        }
+
+        for (; i < chunks_end[input]; i++) {
+            chunk_t *chunk = &job.chunks[i];
+
+            pthread_mutex_lock(&job.mutex);
+            while (!chunk->done)
+                pthread_cond_wait(&job.chunk_done, &job.mutex);
+            pthread_mutex_unlock(&job.mutex);
+
+            write_chunk(colorizer, chunk, i == 0);
+            output_flush(colorizer->output);
+            free(chunk->output.data);
+
+            pthread_mutex_lock(&job.mutex);
+            job.in_flight_bytes -= chunk->length;
+            pthread_cond_broadcast(&job.chunk_written);
+            pthread_mutex_unlock(&job.mutex);
+        }
+    }
+
+    for (int i = 0; i < jobs; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    free(job.chunks);
+    colorizer->output = &stream->output;
+}
+
+static void colorize_window(queercat_stream_t *stream, output_buffer_t *output, output_buffer_t *window, int jobs,
+                            size_t memory_budget, bool whole)
+{
+    const uint8_t *data = (const uint8_t *)window->data;
+    const uint8_t *first_newline = memchr(data, '\n', window->length);
+    const uint8_t *last_newline = memrchr(data, '\n', window->length);
+    size_t start = first_newline ? first_newline - data + 1 : 0;
+    size_t cut = last_newline ? last_newline - data + 1 : 0;
+    size_t end = (whole || !last_newline) ? window->length : cut;
+
+    /* The threads color whole lines. Up to the first newline goes through the stream, completing a
+     * char cut by the last window, and so does the rest of a whole window. A window with a line
+     * longer than itself, or too few lines to share, goes through the stream alone. */
+    if (cut - start >= PARALLEL_MIN_LENGTH) {
+        parallel_input_t lines = { .data = data + start, .length = cut - start };
+
+        feed_stream(stream, output, data, start);
+        colorize_parallel(stream, output, &lines, 1, jobs, memory_budget);
+        feed_stream(stream, output, data + cut, end - cut);
+    } else {
+        feed_stream(stream, output, data, end);
+    }
+
+    /* What is left is the start of a line, the next window goes after it. */
+    window->length -= end;
+    memmove(window->data, window->data + end, window->length);
+}
+
+static int colorize_stdin_parallel(queercat_stream_t *stream, output_buffer_t *output, int jobs, size_t memory_budget)
+{
+    output_buffer_t window = { .fd = OUTPUT_GROWABLE };
+    struct pollfd input = { .fd = STDIN_FILENO, .events = POLLIN };
+    ssize_t result;
+    int error;
+
+    /* Stdin is colored a window at a time, within the memory budget. */
+    window.capacity = (memory_budget > 2 * PARALLEL_MIN_LENGTH) ? memory_budget : 2 * PARALLEL_MIN_LENGTH;
+    window.data = malloc(window.capacity);
+    if (!window.data) {
+        fwprintf(stderr, L"Out of memory\n");
+        exit(2);
+    }
+
+    for (;;) {
+        bool paused;
+
+        result = timed_read(STDIN_FILENO, window.data + window.length, window.capacity - window.length);
+        error = errno;
+        if (result < 0 && error == EINTR)
+            continue;
+        if (result > 0)
+            window.length += result;
+
+        /* A full window is colored up to its last line. When the input pauses or ends, all of it
+         * is, so what comes slowly is not held back. */
+        paused = result <= 0 || poll(&input, 1, 0) == 0;
+        if (paused || window.length == window.capacity)
+            colorize_window(stream, output, &window, jobs, memory_budget, paused);
+        if (result <= 0)
             break;
+    }
 
-        case COLOR_TYPE_ANSII:
-            ncc = offx * pattern->ansii_pattern.codes_count + (int)(char_index * freq_h + line_index * freq_v);
-            if (cc != ncc)
-                wprintf(L"\033[38;5;%hhum", pattern->ansii_pattern.ansii_codes[(rand_offset + (cc = ncc)) % pattern->ansii_pattern.codes_count]);
+    free(window.data);
+    errno = error;
+    return (result < 0) ? -1 : 0;
+}
+
+static size_t colorize_files_parallel(queercat_stream_t *stream, output_buffer_t *output, char **filenames, size_t filenames_count,
+                                      int jobs, size_t memory_budget)
+{
+    parallel_input_t inputs[MAX_PARALLEL_FILES];
+    size_t count = 0;
+
+    /* Map the regular files in a row. Anything else, or a file that cannot be opened, ends the
+     * run and is left to the serial loop, which also reports the errors. */
+    while (count < filenames_count && count < MAX_PARALLEL_FILES) {
+        const char *filename = filenames[count];
+        struct stat st;
+        void *mapping = NULL;
+        int fd;
+
+        if (!strcmp(filename, "--help") || !strcmp(filename, "-"))
+            break;
+        fd = open(filename, O_RDONLY);
+        if (fd < 0)
             break;
+        if (fstat(fd, &st) || !S_ISREG(st.st_mode)
+                || (st.st_size > 0 && (mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)) {
+            close(fd);
+            break;
+        }
+        if (close(fd)) {
+            fwprintf(stderr, L"Error closing input file \"%s\": %s\n", filename, strerror(errno));
+            exit(2);
+        }
 
-        default:
-            exit(1);
+        /* An empty file still ends with a reset. */
+        if (mapping)
+            madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+        inputs[count].data = mapping;
+        inputs[count].length = st.st_size;
+        if (run_stats)
+            run_stats->read.bytes += st.st_size;
+        count++;
+    }
+
+    if (count == 0)
+        return 0;
+    colorize_parallel(stream, output, inputs, count, jobs, memory_budget);
+
+    for (size_t i = 0; i < count; i++)
+        if (inputs[i].length)
+            munmap((void *)inputs[i].data, inputs[i].length);
+    return count;
+}
+
+static int animate_inputs(queercat_stream_t *stream, char **inputs, char **inputs_end, int fps, double duration)
+{
+    output_buffer_t text = { .fd = OUTPUT_GROWABLE };
+    int status;
+
+    /* The whole input is drawn at once, then only its colors move. */
+    for (char **filename = inputs; filename < inputs_end; filename++) {
+        ssize_t result;
+        int fd;
+
+        if (!strcmp(*filename, "--help")) {
+            output_append(&text, helpstr, sizeof(helpstr) - 1);
+            continue;
+        } else if (!strcmp(*filename, "-")) {
+            fd = STDIN_FILENO;
+        } else {
+            fd = open(*filename, O_RDONLY);
+            if (fd < 0) {
+                fwprintf(stderr, L"Cannot open input file \"%s\": %s\n", *filename, strerror(errno));
+                return 2;
+            }
+        }
+
+        do {
+            output_reserve(&text, INPUT_BLOCK_SIZE);
+            result = read(fd, text.data + text.length, text.capacity - text.length);
+            if (result > 0)
+                text.length += result;
+        } while (result > 0 || (result < 0 && errno == EINTR));
+        if (result < 0) {
+            fwprintf(stderr, L"Error reading input file \"%s\": %s\n", *filename, strerror(errno));
+            return 2;
+        }
+        if (fd > STDIN_FILENO)
+            close(fd);
     }
+
+    status = run_animation(stream, (const uint8_t *)text.data, text.length, fps, duration);
+    free(text.data);
+    return status;
+}
+
+static bool is_zero_copy_fallback_error(int error)
+{
+    /* Errors meaning "this method does not apply to these fds", not real I/O errors. */
+    return error == EINVAL || error == ENOSYS || error == EXDEV || error == EBADF
+           || error == ESPIPE || error == EOPNOTSUPP;
+}
+
+static int copy_fd(int in_fd, int out_fd, uint64_t *copied)
+{
+    static char block[INPUT_BLOCK_SIZE];
+    ssize_t result;
+
+#ifdef __linux__
+    struct stat in_stat;
+    struct stat out_stat;
+    bool in_is_file = !fstat(in_fd, &in_stat) && S_ISREG(in_stat.st_mode) && in_stat.st_size > 0;
+    bool any_is_pipe = (!fstat(in_fd, &in_stat) && S_ISFIFO(in_stat.st_mode))
+                       || (!fstat(out_fd, &out_stat) && S_ISFIFO(out_stat.st_mode));
+    uint64_t copied_before = *copied;
+
+    /* Let the kernel move the data when it can. Files with no size (procfs and the like) may
+     * read as empty through copy_file_range and sendfile, so those only handle real files. */
+    if (in_is_file) {
+        while ((result = copy_file_range(in_fd, NULL, out_fd, NULL, ZERO_COPY_CHUNK_SIZE, 0)) > 0 || (result < 0 && errno == EINTR))
+            *copied += (result > 0) ? result : 0;
+        if (result == 0)
+            return 0;
+        if (*copied != copied_before || !is_zero_copy_fallback_error(errno))
+            return -1;
+
+        while ((result = sendfile(out_fd, in_fd, NULL, ZERO_COPY_CHUNK_SIZE)) > 0 || (result < 0 && errno == EINTR))
+            *copied += (result > 0) ? result : 0;
+        if (result == 0)
+            return 0;
+        if (*copied != copied_before || !is_zero_copy_fallback_error(errno))
+            return -1;
+    }
+
+    if (any_is_pipe) {
+        while ((result = splice(in_fd, NULL, out_fd, NULL, ZERO_COPY_CHUNK_SIZE, SPLICE_F_MOVE)) > 0 || (result < 0 && errno == EINTR))
+            *copied += (result > 0) ? result : 0;
+        if (result == 0)
+            return 0;
+        if (*copied != copied_before || !is_zero_copy_fallback_error(errno))
+            return -1;
+    }
+#endif
+
+    /* Plain copy. */
+    while ((result = read(in_fd, block, sizeof(block))) != 0) {
+        if (result < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        for (ssize_t written = 0; written < result; ) {
+            ssize_t write_result = write(out_fd, block + written, result - written);
+            if (write_result < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            written += write_result;
+        }
+        *copied += result;
+    }
+
+    return 0;
 }
 
 int main(int argc, char** argv)
 {
     char* default_argv[] = { "-" };
-    int cc = -1;
+    output_buffer_t output = { .fd = STDOUT_FILENO, .capacity = queercat_output_bound(INPUT_BLOCK_SIZE) };
+    queercat_options_t options;
+    queercat_stream_t *stream;
+    queercat_registry_t *registry = NULL;
+    const char *flag_name = NULL;
+    const char *config_path = NULL;
+    const char *server_path = NULL;
+    const char *client_path = NULL;
     int i = 0;
-    int char_index = 0;
-    int line_index = 0;
-    wint_t current_char = '\0';
-    bool print_colors = isatty(STDOUT_FILENO);
     bool force_locale = true;
     bool random = false;
-    color_type_t color_type = COLOR_TYPE_ANSII;
-    double freq_h = 0.23;
-    double freq_v = 0.1;
-    flag_type_t flag_type = FLAG_TYPE_RAINBOW;
-    const pattern_t *pattern;
+    int jobs = 1;
+    size_t memory_budget = 0;
+    bool streaming = false;
+    bool verbose = false;
+    bool io_uring = false;
+    bool animate = false;
+    bool cache = false;
+    bool follow = false;
+    char **exec_argv = NULL;
+    double cache_mib = DEFAULT_RENDER_CACHE_MIB;
+    int fps = DEFAULT_ANIMATION_FPS;
+    double duration = DEFAULT_ANIMATION_DURATION;
+    uring_pipeline_t *pipeline = NULL;
+    stats_format_t stats_format = STATS_FORMAT_NONE;
+    int stats_fd = STDERR_FILENO;
+    run_stats_t stats = { 0 };
+    int deadline_ms = DEFAULT_STREAM_DEADLINE_MS;
+
+    queercat_options_init(&options);
+    options.print_colors = isatty(STDOUT_FILENO);
 
     struct timeval tv;
     gettimeofday(&tv, NULL);
-    double offx = (tv.tv_sec % 300) / 300.0;
+    options.offx = (tv.tv_sec % 300) / 300.0;
 
     /* Handle flags. */
     for (i = 1; i < argc; i++) {
         char* endptr;
         if (!strcmp(argv[i], "-f") || !strcmp(argv[i], "--flag")) {
             if ((++i) < argc) {
-                flag_type = (flag_type_t)strtod(argv[i], &endptr);
-                if (*endptr)
-                    usage();
+                /* A number is a built-in flag, anything else a name looked up once the config is loaded. */
+                options.flag_type = (flag_type_t)strtod(argv[i], &endptr);
+                if (*endptr || endptr == argv[i])
+                    flag_name = argv[i];
             } else {
                 usage();
             }
+        } else if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "--config")) {
+            if ((++i) < argc)
+                config_path = argv[i];
+            else
+                usage();
         } else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--horizontal-frequency")) {
             if ((++i) < argc) {
-                freq_h = strtod(argv[i], &endptr);
+                options.freq_h = strtod(argv[i], &endptr);
                 if (*endptr)
                     usage();
             } else {
@@ -536,20 +1032,133 @@ int main(int argc, char** argv)
             }
         } else if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--vertical-frequency")) {
             if ((++i) < argc) {
-                freq_v = strtod(argv[i], &endptr);
+                options.freq_v = strtod(argv[i], &endptr);
+                if (*endptr)
+                    usage();
+            } else {
+                usage();
+            }
+        } else if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "--threshold")) {
+            if ((++i) < argc) {
+                options.threshold = strtod(argv[i], &endptr);
                 if (*endptr)
                     usage();
             } else {
                 usage();
             }
+        } else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs")) {
+            if ((++i) < argc) {
+                long count = strtol(argv[i], &endptr, 10);
+                if (*endptr || count < 1 || count > MAX_JOBS)
+                    usage();
+                jobs = count;
+            } else {
+                usage();
+            }
+        } else if (!strcmp(argv[i], "--memory")) {
+            if ((++i) < argc) {
+                double megabytes = strtod(argv[i], &endptr);
+                if (*endptr || megabytes <= 0)
+                    usage();
+                memory_budget = megabytes * 1024 * 1024;
+            } else {
+                usage();
+            }
+        } else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--stream")) {
+            streaming = true;
+        } else if (!strcmp(argv[i], "--follow")) {
+            follow = true;
+        } else if (!strcmp(argv[i], "--exec")) {
+            /* The rest of the line is the command. */
+            if ((++i) < argc) {
+                exec_argv = argv + i;
+                i = argc;
+                break;
+            } else {
+                usage();
+            }
+        } else if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--deadline")) {
+            if ((++i) < argc) {
+                deadline_ms = strtol(argv[i], &endptr, 10);
+                if (*endptr || deadline_ms < 0)
+                    usage();
+            } else {
+                usage();
+            }
         } else if (!strcmp(argv[i], "-F") || !strcmp(argv[i], "--force-color")) {
-            print_colors = true;
+            options.print_colors = true;
         } else if (!strcmp(argv[i], "-l") || !strcmp(argv[i], "--no-force-locale")) {
             force_locale = false;
         } else if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--random")) {
             random = true;
+        } else if (!strcmp(argv[i], "--offset")) {
+            if ((++i) < argc) {
+                options.offx = strtod(argv[i], &endptr);
+                if (*endptr)
+                    usage();
+            } else {
+                usage();
+            }
+        } else if (!strcmp(argv[i], "-a") || !strcmp(argv[i], "--animate")) {
+            animate = true;
+        } else if (!strcmp(argv[i], "--fps")) {
+            if ((++i) < argc) {
+                fps = strtol(argv[i], &endptr, 10);
+                if (*endptr || fps < 1)
+                    usage();
+            } else {
+                usage();
+            }
+        } else if (!strcmp(argv[i], "--duration")) {
+            if ((++i) < argc) {
+                duration = strtod(argv[i], &endptr);
+                if (*endptr || duration < 0)
+                    usage();
+            } else {
+                usage();
+            }
         } else if (!strcmp(argv[i], "-b") || !strcmp(argv[i], "--24bit")) {
-            color_type = COLOR_TYPE_24_BIT;
+            options.color_type = COLOR_TYPE_24_BIT;
+        } else if (!strcmp(argv[i], "-q") || !strcmp(argv[i], "--quantize")) {
+            options.color_type = COLOR_TYPE_ANSII_GRADIENT;
+        } else if (!strcmp(argv[i], "--html")) {
+            options.color_type = COLOR_TYPE_HTML;
+        } else if (!strcmp(argv[i], "--server")) {
+            if ((++i) < argc)
+                server_path = argv[i];
+            else
+                usage();
+        } else if (!strcmp(argv[i], "--connect")) {
+            if ((++i) < argc)
+                client_path = argv[i];
+            else
+                usage();
+        } else if (!strcmp(argv[i], "--stats")) {
+            stats_format = STATS_FORMAT_TEXT;
+        } else if (!strcmp(argv[i], "--stats=json")) {
+            stats_format = STATS_FORMAT_JSON;
+        } else if (!strcmp(argv[i], "--stats-fd")) {
+            if ((++i) < argc) {
+                stats_fd = strtol(argv[i], &endptr, 10);
+                if (*endptr || stats_fd < 0)
+                    usage();
+            } else {
+                usage();
+            }
+        } else if (!strcmp(argv[i], "--cache")) {
+            cache = true;
+        } else if (!strcmp(argv[i], "--cache-size")) {
+            if ((++i) < argc) {
+                cache_mib = strtod(argv[i], &endptr);
+                if (*endptr || cache_mib <= 0)
+                    usage();
+            } else {
+                usage();
+            }
+        } else if (!strcmp(argv[i], "--io-uring")) {
+            io_uring = true;
+        } else if (!strcmp(argv[i], "--verbose")) {
+            verbose = true;
         } else if (!strcmp(argv[i], "--version")) {
             version();
         } else {
@@ -559,16 +1168,47 @@ int main(int argc, char** argv)
         }
     }
 
-    if (flag_type <= FLAG_TYPE_INVALID || flag_type >= FLAG_TYPE_END) {
-        fprintf(stderr, "Invalid flag: %d\n", flag_type);
+    /* A client leaves flags to the server. */
+    if (server_path || (!client_path && (flag_name || config_path)))
+        registry = load_registry(config_path);
+    if (flag_name && !client_path) {
+        options.flag = queercat_registry_find(registry, flag_name);
+        if (!options.flag) {
+            fprintf(stderr, "Invalid flag: %s\n", flag_name);
+            exit(1);
+        }
+    } else if (options.flag_type <= FLAG_TYPE_INVALID || options.flag_type >= FLAG_TYPE_END) {
+        fprintf(stderr, "Invalid flag: %d\n", options.flag_type);
+        exit(1);
+    }
+
+    if (!memory_budget)
+        memory_budget = (size_t)jobs * PARALLEL_CHUNKS_PER_JOB * PARALLEL_CHUNK_SIZE;
+
+    /* HTML is colored even into a file, that is where it goes. */
+    if (options.color_type == COLOR_TYPE_HTML)
+        options.print_colors = true;
+
+    /* Only the runs reading and writing the inputs themselves are counted and timed. */
+    if (stats_format != STATS_FORMAT_NONE && (exec_argv || follow || client_path || server_path
+            || (animate && options.print_colors && options.color_type != COLOR_TYPE_HTML))) {
+        fprintf(stderr, "--stats cannot be used with --exec, --follow, --animate, --server or --connect\n");
         exit(1);
     }
 
     /* Handle randomness. */
-    int rand_offset = 0;
     if (random) {
         srand(time(NULL));
-        rand_offset = rand();
+        options.rand_offset = rand();
+    }
+
+    /* Serve streams, or have the server color ours. */
+    if (server_path) {
+        if (queercat_registry_compile(registry)) {
+            fprintf(stderr, "Cannot compile the flags: %s\n", strerror(errno));
+            exit(2);
+        }
+        return run_server(server_path, registry);
     }
 
     /* Get inputs. */
@@ -579,6 +1219,9 @@ int main(int argc, char** argv)
         inputs_end = inputs + 1;
     }
 
+    if (client_path)
+        return run_client(client_path, &options, flag_name, inputs, inputs_end - inputs);
+
     /* Handle locale. */
     char* env_lang = getenv("LANG");
     if (force_locale && env_lang && !strstr(env_lang, "UTF-8")) {
@@ -589,78 +1232,174 @@ int main(int argc, char** argv)
         setlocale(LC_ALL, "");
     }
 
-    /* Get pattern. */
-    pattern = get_pattern(flag_type);
+    /* Prepare the stream, and an output buffer big enough for one block of input. */
+    stream = queercat_stream_new(&options);
+    output.data = malloc(output.capacity);
+    if (!stream || !output.data) {
+        fprintf(stderr, "Cannot create the stream: %s\n", strerror(errno));
+        exit(2);
+    }
+    if (verbose)
+        fwprintf(stderr, L"Coloring kernel: %s\n", queercat_stream_kernel(stream));
+
+    /* The command's output is the only input. */
+    if (exec_argv) {
+        int status = run_exec(stream, exec_argv);
+        queercat_stream_free(stream);
+        queercat_registry_free(registry);
+        free(output.data);
+        return status;
+    }
+
+    /* Files followed each get a stream of their own, of the flag in the registry. */
+    if (follow) {
+        int status = run_follow(&options, inputs, inputs_end - inputs);
+        queercat_stream_free(stream);
+        queercat_registry_free(registry);
+        free(output.data);
+        return status;
+    }
+
+    /* The cache only saves time, coloring goes on without it. */
+    if (cache && options.print_colors) {
+        char *cache_directory = user_file_path("XDG_CACHE_HOME", ".cache", RENDER_CACHE_DIRECTORY_NAME);
+
+        if (cache_directory) {
+            make_parent_directories(cache_directory);
+            render_cache = render_cache_open(cache_directory, cache_mib * 1024 * 1024);
+        }
+        if (verbose && !render_cache)
+            fwprintf(stderr, L"No render cache: %s\n", cache_directory ? strerror(errno) : "no cache directory");
+        free(cache_directory);
+    }
+
+    /* Without colors there is nothing to animate, nor in HTML. */
+    if (animate && options.print_colors && options.color_type != COLOR_TYPE_HTML) {
+        int status = animate_inputs(stream, inputs, inputs_end, fps, duration);
+        queercat_stream_free(stream);
+        queercat_registry_free(registry);
+        free(output.data);
+        return status;
+    }
+
+    /* Without io_uring, inputs are read and written in turn. */
+    if (io_uring) {
+        pipeline = uring_pipeline_new();
+        if (verbose && pipeline)
+            fwprintf(stderr, L"I/O: io_uring\n");
+        else if (verbose)
+            fwprintf(stderr, L"I/O: read and write, no io_uring: %s\n", strerror(errno));
+    }
+    if (verbose && jobs > 1 && render_cache)
+        fwprintf(stderr, L"-j: files are colored one by one, through the cache\n");
+    else if (verbose && jobs > 1 && pipeline && !streaming)
+        fwprintf(stderr, L"-j: files are mapped and colored side by side, without io_uring\n");
+    if (stats_format != STATS_FORMAT_NONE) {
+        run_stats = &stats;
+        run_stats->start_wall_ns = clock_ns(CLOCK_MONOTONIC);
+        run_stats->start_cpu_ns = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+        output.stats = &run_stats->write;
+    }
+    if (options.color_type == COLOR_TYPE_HTML)
+        output_write(&output, HTML_START, strlen(HTML_START));
 
     /* For file in inputs. */
     for (char** filename = inputs; filename < inputs_end; filename++) {
-        wint_t (*this_file_read_wchar)(FILE*); /* Used for --help because fmemopen is universally broken when used with fgetwc */
-        FILE* f;
-        escape_state_t escape_state = ESCAPE_STATE_OUT;
+        int fd;
+
+        /* With -j, regular files in a row are colored side by side, and written in order. They are
+         * mapped, not read with io_uring. With a cache, each file goes through it instead. */
+        if (jobs > 1 && options.print_colors && !streaming && !render_cache) {
+            size_t count = colorize_files_parallel(stream, &output, filename, inputs_end - filename, jobs, memory_budget);
+            if (count) {
+                flush_stream(stream, &output);
+                filename += count - 1;
+                continue;
+            }
+        }
 
         /* Handle "--help", "-" (STDIN) and file names. */
         if (!strcmp(*filename, "--help")) {
-            this_file_read_wchar = &helpstr_hack;
-            f = 0;
+            if (!render_cache || !render_cache_colorize(render_cache, stream, &output, (const uint8_t *)helpstr, sizeof(helpstr) - 1))
+                feed_stream(stream, &output, (const uint8_t *)helpstr, sizeof(helpstr) - 1);
+            if (run_stats)
+                run_stats->read.bytes += sizeof(helpstr) - 1;
+            fd = -1;
 
         } else if (!strcmp(*filename, "-")) {
-            this_file_read_wchar = &fgetwc;
-            f = stdin;
+            fd = STDIN_FILENO;
 
         } else {
-            this_file_read_wchar = &fgetwc;
-            f = fopen(*filename, "r");
-            if (!f) {
+            fd = open(*filename, O_RDONLY);
+            if (fd < 0) {
                 fwprintf(stderr, L"Cannot open input file \"%s\": %s\n", *filename, strerror(errno));
                 return 2;
             }
         }
 
-        /* While there are chars to read. */
-        while ((current_char = this_file_read_wchar(f)) != WEOF) {
-
-            /* If set to print colors, handle the colors. */
-            if (print_colors) {
-
-                /* Skip escape sequences. */
-                find_escape_sequences(current_char, &escape_state);
-                if (escape_state == ESCAPE_STATE_OUT) {
-
-                    /* Handle newlines. */
-                    if (current_char == '\n') {
-                        line_index++;
-                        char_index = 0;
-                    } else {
-                        char_index += wcwidth(current_char);
-                        print_color(pattern, color_type, char_index, line_index, freq_h, freq_v, offx, rand_offset, cc);
-                    }
-                }
+        /* Without colors the output is the input, copy it as is. Otherwise read and colorize the whole input. */
+        if (fd >= 0 && !options.print_colors) {
+            uint64_t copied = 0;
+            stage_clock_t clock = { 0 };
+            int result;
+
+            /* Copying is both reading and writing, the time is counted as writing. */
+            if (run_stats)
+                stage_begin(&clock);
+            result = copy_fd(fd, STDOUT_FILENO, &copied);
+            if (run_stats) {
+                stage_end(&run_stats->write, &clock, copied);
+                run_stats->read.bytes += copied;
             }
-
-            /* Print the char. */
-            putwchar(current_char);
-
-            if (escape_state == ESCAPE_STATE_LAST) {  /* implies "print_colors" */
-                print_color(pattern, color_type, char_index, line_index, freq_h, freq_v, offx, rand_offset, cc);
+            if (result) {
+                fwprintf(stderr, L"Error copying input file \"%s\": %s\n", *filename, strerror(errno));
+                return 2;
             }
-        }
-
-        if (print_colors)
-            wprintf(L"\033[0m");
-
-        cc = -1;
-
-        if (f) {
-            if (ferror(f)) {
+        } else if (fd >= 0) {
+            /* Named regular files are mapped, anything else is read. With io_uring they are read
+             * too: reading them ahead overlaps better than page faults. */
+            bool mapped = fd != STDIN_FILENO && !pipeline && colorize_mapped_file(stream, &output, fd);
+            int result = 0;
+            if (!mapped) {
+                if (streaming)
+                    result = colorize_fd_streaming(stream, fd, deadline_ms);
+                else if (fd == STDIN_FILENO && jobs > 1)
+                    result = colorize_stdin_parallel(stream, &output, jobs, memory_budget);
+                else if (pipeline)
+                    result = uring_colorize_fd(pipeline, stream, fd, STDOUT_FILENO, run_stats ? &run_stats->read : NULL,
+                                               output.stats);
+                else
+                    result = colorize_fd(stream, &output, fd);
+            }
+            if (result) {
                 fwprintf(stderr, L"Error reading input file \"%s\": %s\n", *filename, strerror(errno));
-                fclose(f);
+                flush_stream(stream, &output);
                 return 2;
             }
+        }
 
-            if (fclose(f)) {
-                fwprintf(stderr, L"Error closing input file \"%s\": %s\n", *filename, strerror(errno));
-                return 2;
-            }
+        /* Write out what was held back and reset the colors. */
+        flush_stream(stream, &output);
+
+        if (fd > STDIN_FILENO && close(fd)) {
+            fwprintf(stderr, L"Error closing input file \"%s\": %s\n", *filename, strerror(errno));
+            return 2;
         }
     }
+
+    if (options.color_type == COLOR_TYPE_HTML)
+        output_write(&output, HTML_END, strlen(HTML_END));
+
+    if (run_stats) {
+        queercat_stats_t stream_stats;
+
+        queercat_stream_stats(stream, &stream_stats);
+        print_stats(stats_fd, stats_format, &stream_stats);
+    }
+
+    uring_pipeline_free(pipeline);
+    render_cache_close(render_cache);
+    queercat_stream_free(stream);
+    queercat_registry_free(registry);
+    free(output.data);
 }
@@ -0,0 +1,1459 @@
+#define _GNU_SOURCE
+
+/* *** Includes ******************************************************/
+#include <stdbool.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <wchar.h>
+#include "math.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+#include "queercat_internal.h"
+#include "unicode_tables.h"
+#include "palette_table.h"
+
+
+/* *** Flags *********************************************************/
+const pattern_t rainbow = {
+    .name = "rainbow",
+    .ansii_pattern = {
+        .codes_count = 30,
+        .ansii_codes = { 39, 38, 44, 43, 49, 48, 84, 83, 119, 118, 154, 148, 184, 178,
+        214, 208, 209, 203, 204, 198, 199, 163, 164, 128, 129, 93, 99, 63, 69, 33 }
+    },
+    .color_pattern = { 0 },
+    .get_color = get_color_rainbow
+};
+
+const pattern_t transgender = {
+    .name = "transgender",
+    .ansii_pattern = {
+        .codes_count = 10,
+        .ansii_codes = {117, 117,  225, 225,  255, 255,  225, 225,  117, 117}
+    },
+    .color_pattern = {
+        .stripes_count = 5,
+        .stripes_colors = {
+            0x55cdfc, /* #55cdfd - Blue */
+            0xf7a8b8, /* #f7a8b8 - Pink */
+            0xffffff, /* #ffffff - White */
+            0xf7a8b8, /* #f7a8b8 - Pink */
+            0x55cdfc  /* #55cdfc - Blue */
+        },
+        .factor = 4.0f
+    },
+    .get_color = get_color_stripes
+};
+
+const pattern_t nonbinary = {
+    .name = "nonbinary",
+    .ansii_pattern = {
+        .codes_count = 8,
+        .ansii_codes = {226, 226, 255, 255, 93, 93, 234, 234}
+    },
+    .color_pattern = {
+        .stripes_count = 4,
+        .stripes_colors = {
+            0xffff00, /* #ffff00 - Yellow */
+            0xb000ff, /* #b000ff - Purple */
+            0xffffff, /* #ffffff - White */
+            0x000000  /* #000000 - Black */
+        },
+        .factor = 4.0f
+    },
+    .get_color = get_color_stripes
+};
+
+const pattern_t lesbian = {
+    .name = "lesbian",
+    .ansii_pattern = {
+        .codes_count = 5,
+        .ansii_codes = {196, 208, 255, 170, 128}
+    },
+    .color_pattern = {
+        .stripes_count = 5,
+        .stripes_colors = {
+            0xff0000, /* #ff0000 - Red */
+            0xff993f, /* #ff993f - Orange */
+            0xffffff, /* #ffffff - White */
+            0xff8cbd, /* #ff8cbd - Pink */
+            0xff4284  /* #ff4284 - Purple */
+        },
+        .factor = 2.0f
+    },
+    .get_color = get_color_stripes
+};
+
+const pattern_t gay = {
+    .name = "gay",
+    .ansii_pattern = {
+        .codes_count = 7,
+        .ansii_codes = {36, 49, 121, 255, 117, 105, 92}
+    },
+    .color_pattern = {
+        .stripes_count = 5,
+        .stripes_colors = {
+            0x00b685, /* #00b685 - Teal */
+            0x6bffb6, /* #6bffb6 - Green */
+            0xffffff, /* #ffffff - White */
+            0x8be1ff, /* #8be1ff - Blue */
+            0x8e1ae1  /* #8e1ae1 - Purple */
+        },
+        .factor = 6.0f
+    },
+    .get_color = get_color_stripes
+};
+
+const pattern_t pansexual = {
+    .name = "pansexual",
+    .ansii_pattern = {
+        .codes_count = 9,
+        .ansii_codes = {200, 200, 200,  227, 227, 227,  45, 45, 45}
+    },
+    .color_pattern = {
+        .stripes_count = 3,
+        .stripes_colors = {
+            0xff3388, /* #ff3388 - Pink */
+            0xffea00, /* #ffea00 - Yellow */
+            0x00dbff  /* #00dbff - Cyan */
+        },
+        .factor = 8.0f
+    },
+    .get_color = get_color_stripes
+};
+
+const pattern_t bisexual = {
+    .name = "bisexual",
+    .ansii_pattern = {
+        .codes_count = 8,
+        .ansii_codes = {162, 162, 162,  129, 129, 27, 27, 27}
+    },
+    .color_pattern = {
+        .stripes_count = 5,
+        .stripes_colors = {
+            0xff3b7b, /* #ff3b7b - Pink */
+            0xff3b7b, /* #ff3b7b - Pink */
+            0xd06bcc, /* #d06bcc - Purple */
+            0x3b72ff, /* #3b72ff - Blue */
+            0x3b72ff  /* #3b72ff - Blue */
+        },
+        .factor = 4.0f
+    },
+    .get_color = get_color_stripes
+};
+
+const pattern_t gender_fluid = {
+    .name = "gender_fluid",
+    .ansii_pattern = {
+        .codes_count = 10,
+        .ansii_codes = {219, 219, 255, 255, 128, 128, 234, 234, 20, 20}
+    },
+    .color_pattern = {
+        .stripes_count = 5,
+        .stripes_colors = {
+            0xffa0bc, /* #ffa0bc - Pink */
+            0xffffff, /* #ffffff - White */
+            0xc600e4, /* #c600e4 - Purple */
+            0x000000, /* #000000 - Black */
+            0x4e3cbb  /* #4e3cbb - Blue */
+        },
+        .factor = 2.0f
+    },
+    .get_color = get_color_stripes
+};
+
+const pattern_t asexual = {
+    .name = "asexual",
+    .ansii_pattern = {
+        .codes_count = 8,
+        .ansii_codes = {233, 233, 247, 247, 255, 255, 5, 5}
+    },
+    .color_pattern = {
+        .stripes_count = 4,
+        .stripes_colors = {
+            0x000000, /* #000000 - Black */
+            0xa3a3a3, /* #a3a3a3 - Gray */
+            0xffffff, /* #ffffff - White */
+            0x800080  /* #800080 - Purple */
+        },
+        .factor = 4.0f
+    },
+    .get_color = get_color_stripes
+};
+
+const pattern_t unlabeled = {
+    .name = "unlabeled",
+    .ansii_pattern = {
+        .codes_count = 8,
+        .ansii_codes = {194, 194, 255, 255, 195, 195, 223, 223}
+    },
+    .color_pattern = {
+        .stripes_count = 4,
+        .stripes_colors = {
+            0xe6f9e3, /* #e6f9e3 - Green */
+            0xfdfdfb, /* #fdfdfb - White */
+            0xdeeff9, /* #deeff9 - Blue */
+            0xfae1c2  /* #fae1c2 - Orange */
+        },
+        .factor = 4.0f
+    },
+    .get_color = get_color_stripes
+};
+
+/* *** Escape Sequences **********************************************/
+/* Byte classes, for the escape sequence transitions. */
+typedef enum escape_class_e {
+    ESCAPE_CLASS_CONTROL = 0,    /* C0 controls, run in place without ending a sequence */
+    ESCAPE_CLASS_BEL,
+    ESCAPE_CLASS_CANCEL,         /* CAN and SUB, abort a sequence */
+    ESCAPE_CLASS_ESCAPE,
+    ESCAPE_CLASS_INTERMEDIATE,   /* 0x20-0x2f */
+    ESCAPE_CLASS_PARAMETER,      /* 0x30-0x3f */
+    ESCAPE_CLASS_FINAL,          /* 0x40-0x7e, except the ones below */
+    ESCAPE_CLASS_CSI,            /* [ */
+    ESCAPE_CLASS_OSC,            /* ] */
+    ESCAPE_CLASS_CONTROL_STRING, /* P, X, ^ and _ */
+    ESCAPE_CLASS_IGNORED,        /* DEL and anything not ASCII */
+    ESCAPE_CLASS_COUNT
+} escape_class_t;
+
+static const uint8_t escape_classes[256] = {
+    [0x00 ... 0x06] = ESCAPE_CLASS_CONTROL,
+    [0x07] = ESCAPE_CLASS_BEL,
+    [0x08 ... 0x17] = ESCAPE_CLASS_CONTROL,
+    [0x18] = ESCAPE_CLASS_CANCEL,
+    [0x19] = ESCAPE_CLASS_CONTROL,
+    [0x1a] = ESCAPE_CLASS_CANCEL,
+    [0x1b] = ESCAPE_CLASS_ESCAPE,
+    [0x1c ... 0x1f] = ESCAPE_CLASS_CONTROL,
+    [0x20 ... 0x2f] = ESCAPE_CLASS_INTERMEDIATE,
+    [0x30 ... 0x3f] = ESCAPE_CLASS_PARAMETER,
+    [0x40 ... 0x4f] = ESCAPE_CLASS_FINAL,
+    [0x50] = ESCAPE_CLASS_CONTROL_STRING,
+    [0x51 ... 0x57] = ESCAPE_CLASS_FINAL,
+    [0x58] = ESCAPE_CLASS_CONTROL_STRING,
+    [0x59 ... 0x5a] = ESCAPE_CLASS_FINAL,
+    [0x5b] = ESCAPE_CLASS_CSI,
+    [0x5c] = ESCAPE_CLASS_FINAL, /* ESC \ is ST, ending strings */
+    [0x5d] = ESCAPE_CLASS_OSC,
+    [0x5e ... 0x5f] = ESCAPE_CLASS_CONTROL_STRING,
+    [0x60 ... 0x7e] = ESCAPE_CLASS_FINAL,
+    [0x7f ... 0xff] = ESCAPE_CLASS_IGNORED
+};
+
+/* Next state, by state and byte class. An ESC always starts over, so ST needs no state of its own. */
+static const uint8_t escape_transitions[ESCAPE_STATE_COUNT][ESCAPE_CLASS_COUNT] = {
+    [ESCAPE_STATE_OUT] = {
+        /* Anything else is ESCAPE_STATE_OUT. */
+        [ESCAPE_CLASS_ESCAPE] = ESCAPE_STATE_ESCAPE
+    },
+    [ESCAPE_STATE_LAST] = {
+        /* Anything else is ESCAPE_STATE_OUT. */
+        [ESCAPE_CLASS_ESCAPE] = ESCAPE_STATE_ESCAPE
+    },
+    [ESCAPE_STATE_ESCAPE] = {
+        [ESCAPE_CLASS_CONTROL] = ESCAPE_STATE_ESCAPE,
+        [ESCAPE_CLASS_BEL] = ESCAPE_STATE_ESCAPE,
+        [ESCAPE_CLASS_CANCEL] = ESCAPE_STATE_LAST,
+        [ESCAPE_CLASS_ESCAPE] = ESCAPE_STATE_ESCAPE,
+        [ESCAPE_CLASS_INTERMEDIATE] = ESCAPE_STATE_INTERMEDIATE,
+        [ESCAPE_CLASS_PARAMETER] = ESCAPE_STATE_LAST,
+        [ESCAPE_CLASS_FINAL] = ESCAPE_STATE_LAST,
+        [ESCAPE_CLASS_CSI] = ESCAPE_STATE_CSI,
+        [ESCAPE_CLASS_OSC] = ESCAPE_STATE_OSC,
+        [ESCAPE_CLASS_CONTROL_STRING] = ESCAPE_STATE_CONTROL_STRING,
+        [ESCAPE_CLASS_IGNORED] = ESCAPE_STATE_ESCAPE
+    },
+    [ESCAPE_STATE_INTERMEDIATE] = {
+        [ESCAPE_CLASS_CONTROL] = ESCAPE_STATE_INTERMEDIATE,
+        [ESCAPE_CLASS_BEL] = ESCAPE_STATE_INTERMEDIATE,
+        [ESCAPE_CLASS_CANCEL] = ESCAPE_STATE_LAST,
+        [ESCAPE_CLASS_ESCAPE] = ESCAPE_STATE_ESCAPE,
+        [ESCAPE_CLASS_INTERMEDIATE] = ESCAPE_STATE_INTERMEDIATE,
+        [ESCAPE_CLASS_PARAMETER] = ESCAPE_STATE_LAST,
+        [ESCAPE_CLASS_FINAL] = ESCAPE_STATE_LAST,
+        [ESCAPE_CLASS_CSI] = ESCAPE_STATE_LAST,
+        [ESCAPE_CLASS_OSC] = ESCAPE_STATE_LAST,
+        [ESCAPE_CLASS_CONTROL_STRING] = ESCAPE_STATE_LAST,
+        [ESCAPE_CLASS_IGNORED] = ESCAPE_STATE_INTERMEDIATE
+    },
+    [ESCAPE_STATE_CSI] = {
+        [ESCAPE_CLASS_CONTROL] = ESCAPE_STATE_CSI,
+        [ESCAPE_CLASS_BEL] = ESCAPE_STATE_CSI,
+        [ESCAPE_CLASS_CANCEL] = ESCAPE_STATE_LAST,
+        [ESCAPE_CLASS_ESCAPE] = ESCAPE_STATE_ESCAPE,
+        [ESCAPE_CLASS_INTERMEDIATE] = ESCAPE_STATE_CSI,
+        [ESCAPE_CLASS_PARAMETER] = ESCAPE_STATE_CSI,
+        [ESCAPE_CLASS_FINAL] = ESCAPE_STATE_LAST,
+        [ESCAPE_CLASS_CSI] = ESCAPE_STATE_LAST,
+        [ESCAPE_CLASS_OSC] = ESCAPE_STATE_LAST,
+        [ESCAPE_CLASS_CONTROL_STRING] = ESCAPE_STATE_LAST,
+        [ESCAPE_CLASS_IGNORED] = ESCAPE_STATE_CSI
+    },
+    [ESCAPE_STATE_OSC] = {
+        [ESCAPE_CLASS_CONTROL] = ESCAPE_STATE_OSC,
+        [ESCAPE_CLASS_BEL] = ESCAPE_STATE_LAST,
+        [ESCAPE_CLASS_CANCEL] = ESCAPE_STATE_LAST,
+        [ESCAPE_CLASS_ESCAPE] = ESCAPE_STATE_ESCAPE,
+        [ESCAPE_CLASS_INTERMEDIATE] = ESCAPE_STATE_OSC,
+        [ESCAPE_CLASS_PARAMETER] = ESCAPE_STATE_OSC,
+        [ESCAPE_CLASS_FINAL] = ESCAPE_STATE_OSC,
+        [ESCAPE_CLASS_CSI] = ESCAPE_STATE_OSC,
+        [ESCAPE_CLASS_OSC] = ESCAPE_STATE_OSC,
+        [ESCAPE_CLASS_CONTROL_STRING] = ESCAPE_STATE_OSC,
+        [ESCAPE_CLASS_IGNORED] = ESCAPE_STATE_OSC
+    },
+    [ESCAPE_STATE_CONTROL_STRING] = {
+        [ESCAPE_CLASS_CONTROL] = ESCAPE_STATE_CONTROL_STRING,
+        [ESCAPE_CLASS_BEL] = ESCAPE_STATE_CONTROL_STRING,
+        [ESCAPE_CLASS_CANCEL] = ESCAPE_STATE_LAST,
+        [ESCAPE_CLASS_ESCAPE] = ESCAPE_STATE_ESCAPE,
+        [ESCAPE_CLASS_INTERMEDIATE] = ESCAPE_STATE_CONTROL_STRING,
+        [ESCAPE_CLASS_PARAMETER] = ESCAPE_STATE_CONTROL_STRING,
+        [ESCAPE_CLASS_FINAL] = ESCAPE_STATE_CONTROL_STRING,
+        [ESCAPE_CLASS_CSI] = ESCAPE_STATE_CONTROL_STRING,
+        [ESCAPE_CLASS_OSC] = ESCAPE_STATE_CONTROL_STRING,
+        [ESCAPE_CLASS_CONTROL_STRING] = ESCAPE_STATE_CONTROL_STRING,
+        [ESCAPE_CLASS_IGNORED] = ESCAPE_STATE_CONTROL_STRING
+    }
+};
+
+
+/* *** Functions Declarations ****************************************/
+/* Helpers */
+static size_t scan_escape_sequence(const uint8_t *bytes, size_t length, escape_state_t *state);
+static size_t utf8_decode(const uint8_t *bytes, size_t length, wint_t *code_point);
+
+/* Unicode */
+static uint8_t unicode_lookup(wint_t code_point);
+static bool is_grapheme_break(const grapheme_state_t *state, grapheme_class_t grapheme_class);
+static void advance_grapheme(grapheme_state_t *state, grapheme_class_t grapheme_class);
+
+/* Scanning */
+static scan_ascii_f scan_ascii_scalar;
+#ifdef HAVE_X86_SIMD
+static scan_ascii_f scan_ascii_sse2;
+static scan_ascii_f scan_ascii_avx2;
+#endif
+
+/* Colors handling */
+static void mix_colors(uint32_t color1, uint32_t color2, float balance, float factor, color_t *output_color);
+static void set_escape_code(escape_code_t *escape_code, const char *format, ...);
+static uint32_t phase_from_periods(double periods);
+
+/* Kernels */
+static void layout_open_cell(colorizer_t *colorizer);
+static void layout_close_cell(colorizer_t *colorizer);
+static void layout_advance(colorizer_t *colorizer, wint_t current_char, int width);
+static void print_color(colorizer_t *colorizer, kernel_type_t kernel_type);
+static void append_html_char(output_buffer_t *output, uint8_t byte);
+static void colorize_ascii_run(colorizer_t *colorizer, const uint8_t *run, size_t length, kernel_type_t kernel_type);
+static size_t colorize_block_kernel(colorizer_t *colorizer, const uint8_t *block, size_t length, bool final, kernel_type_t kernel_type);
+static colorize_block_f colorize_block_plain;
+static colorize_block_f colorize_block_ansii;
+static colorize_block_f colorize_block_ansii_gradient;
+static colorize_block_f colorize_block_24_bit;
+static colorize_block_f colorize_block_24_bit_threshold;
+static colorize_block_f colorize_block_html;
+static colorize_block_f colorize_block_layout;
+
+static const kernel_t kernels[KERNEL_TYPE_COUNT] = {
+    [KERNEL_TYPE_PLAIN] = { "plain", colorize_block_plain },
+    [KERNEL_TYPE_ANSII] = { "ansi", colorize_block_ansii },
+    [KERNEL_TYPE_ANSII_GRADIENT] = { "ansi gradient", colorize_block_ansii_gradient },
+    [KERNEL_TYPE_24_BIT] = { "24-bit", colorize_block_24_bit },
+    [KERNEL_TYPE_24_BIT_THRESHOLD] = { "24-bit threshold", colorize_block_24_bit_threshold },
+    [KERNEL_TYPE_HTML] = { "html", colorize_block_html },
+    [KERNEL_TYPE_LAYOUT] = { "layout", colorize_block_layout }
+};
+
+/* *** Functions *****************************************************/
+static size_t scan_escape_sequence(const uint8_t *bytes, size_t length, escape_state_t *state)
+{
+    escape_state_t current_state = *state;
+    size_t position = 0;
+
+    /* Returns the length up to the end of the sequence, or all of it if the sequence goes on. */
+    while (position < length) {
+        current_state = escape_transitions[current_state][escape_classes[bytes[position++]]];
+        if (current_state == ESCAPE_STATE_LAST)
+            break;
+    }
+
+    *state = current_state;
+    return position;
+}
+
+static size_t utf8_decode(const uint8_t *bytes, size_t length, wint_t *code_point)
+{
+    uint8_t lead = bytes[0];
+    size_t sequence_length;
+    wint_t value;
+    wint_t min_value;
+
+    /* Returns the length of the sequence, or 0 if it is cut short by the end of the buffer.
+     * Invalid bytes are returned one at a time as UTF8_INVALID. */
+    if (lead < 0x80) {
+        *code_point = lead;
+        return 1;
+    } else if (0xc2 <= lead && lead <= 0xdf) {
+        sequence_length = 2;
+        value = lead & 0x1f;
+        min_value = 0x80;
+    } else if (0xe0 <= lead && lead <= 0xef) {
+        sequence_length = 3;
+        value = lead & 0x0f;
+        min_value = 0x800;
+    } else if (0xf0 <= lead && lead <= 0xf4) {
+        sequence_length = 4;
+        value = lead & 0x07;
+        min_value = 0x10000;
+    } else {
+        *code_point = UTF8_INVALID;
+        return 1;
+    }
+
+    for (size_t i = 1; i < sequence_length; i++) {
+        if (i == length)
+            return 0;
+        if ((bytes[i] & 0xc0) != 0x80) {
+            *code_point = UTF8_INVALID;
+            return 1;
+        }
+        value = (value << 6) | (bytes[i] & 0x3f);
+
+        /* Reject overlong forms, surrogates and values past U+10FFFF as early as possible. */
+        if (i == 1 && sequence_length > 2) {
+            wint_t top = value << (6 * (sequence_length - 2));
+            if (top < min_value || (0xd800 <= top && top <= 0xdfff) || top > 0x10ffff) {
+                *code_point = UTF8_INVALID;
+                return 1;
+            }
+        }
+    }
+
+    *code_point = value;
+    return sequence_length;
+}
+
+static uint8_t unicode_lookup(wint_t code_point)
+{
+    return unicode_properties[unicode_blocks[code_point >> UNICODE_BLOCK_BITS]][code_point & (UNICODE_BLOCK_SIZE - 1)];
+}
+
+static bool is_grapheme_break(const grapheme_state_t *state, grapheme_class_t grapheme_class)
+{
+    grapheme_class_t previous = state->previous_class;
+
+    /* UAX #29 rules, in order. CR LF stays together, other controls stand alone. */
+    if (previous == GRAPHEME_CLASS_CR && grapheme_class == GRAPHEME_CLASS_LF)
+        return false;
+    if (previous <= GRAPHEME_CLASS_LF || grapheme_class <= GRAPHEME_CLASS_LF)
+        return true;
+
+    /* Hangul syllables. */
+    if (previous == GRAPHEME_CLASS_L && (grapheme_class == GRAPHEME_CLASS_L || grapheme_class == GRAPHEME_CLASS_V
+                                         || grapheme_class == GRAPHEME_CLASS_LV || grapheme_class == GRAPHEME_CLASS_LVT))
+        return false;
+    if ((previous == GRAPHEME_CLASS_LV || previous == GRAPHEME_CLASS_V)
+            && (grapheme_class == GRAPHEME_CLASS_V || grapheme_class == GRAPHEME_CLASS_T))
+        return false;
+    if ((previous == GRAPHEME_CLASS_LVT || previous == GRAPHEME_CLASS_T) && grapheme_class == GRAPHEME_CLASS_T)
+        return false;
+
+    /* Marks and joiners extend what is before them, prepended chars what is after them. */
+    if (grapheme_class == GRAPHEME_CLASS_EXTEND || grapheme_class == GRAPHEME_CLASS_ZWJ
+            || grapheme_class == GRAPHEME_CLASS_SPACING_MARK || previous == GRAPHEME_CLASS_PREPEND)
+        return false;
+
+    /* Emoji ZWJ sequences, and flags made of regional indicator pairs. */
+    if (previous == GRAPHEME_CLASS_ZWJ && grapheme_class == GRAPHEME_CLASS_EXTENDED_PICTOGRAPHIC && state->emoji)
+        return false;
+    if (previous == GRAPHEME_CLASS_REGIONAL_INDICATOR && grapheme_class == GRAPHEME_CLASS_REGIONAL_INDICATOR)
+        return !state->odd_regional_indicators;
+
+    return true;
+}
+
+static void advance_grapheme(grapheme_state_t *state, grapheme_class_t grapheme_class)
+{
+    if (grapheme_class == GRAPHEME_CLASS_EXTENDED_PICTOGRAPHIC)
+        state->emoji = true;
+    else if (grapheme_class != GRAPHEME_CLASS_EXTEND && grapheme_class != GRAPHEME_CLASS_ZWJ)
+        state->emoji = false;
+    state->odd_regional_indicators = grapheme_class == GRAPHEME_CLASS_REGIONAL_INDICATOR && !state->odd_regional_indicators;
+    state->previous_class = grapheme_class;
+}
+
+static size_t scan_ascii_scalar(const uint8_t *bytes, size_t length)
+{
+    size_t position = 0;
+
+    while (position < length && 0x20 <= bytes[position] && bytes[position] < 0x7f)
+        position++;
+
+    return position;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static size_t scan_ascii_sse2(const uint8_t *bytes, size_t length)
+{
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i delete = _mm_set1_epi8(0x7f);
+    size_t position = 0;
+
+    /* Signed compare: bytes from 0x80 up are negative, so they are caught with the controls. */
+    for (; position + sizeof(__m128i) <= length; position += sizeof(__m128i)) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(bytes + position));
+        __m128i stop = _mm_or_si128(_mm_cmplt_epi8(chunk, space), _mm_cmpeq_epi8(chunk, delete));
+        unsigned int mask = _mm_movemask_epi8(stop);
+        if (mask)
+            return position + __builtin_ctz(mask);
+    }
+
+    return position + scan_ascii_scalar(bytes + position, length - position);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_ascii_avx2(const uint8_t *bytes, size_t length)
+{
+    const __m256i space = _mm256_set1_epi8(0x20);
+    const __m256i delete = _mm256_set1_epi8(0x7f);
+    size_t position = 0;
+
+    for (; position + sizeof(__m256i) <= length; position += sizeof(__m256i)) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(bytes + position));
+        __m256i stop = _mm256_or_si256(_mm256_cmpgt_epi8(space, chunk), _mm256_cmpeq_epi8(chunk, delete));
+        unsigned int mask = _mm256_movemask_epi8(stop);
+        if (mask)
+            return position + __builtin_ctz(mask);
+    }
+
+    return position + scan_ascii_sse2(bytes + position, length - position);
+}
+#endif
+
+scan_ascii_f *select_scan_ascii(void)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return scan_ascii_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return scan_ascii_sse2;
+#endif
+    return scan_ascii_scalar;
+}
+
+void write_all(int fd, const void *bytes, size_t length)
+{
+    size_t written = 0;
+
+    while (written < length) {
+        ssize_t result = write(fd, (const char *)bytes + written, length - written);
+        if (result < 0) {
+            if (errno == EINTR)
+                continue;
+            fwprintf(stderr, L"Error writing output: %s\n", strerror(errno));
+            exit(2);
+        }
+        written += result;
+    }
+}
+
+void output_write(output_buffer_t *output, const void *bytes, size_t length)
+{
+    stage_clock_t clock;
+
+    if (!output->stats) {
+        write_all(output->fd, bytes, length);
+        return;
+    }
+    stage_begin(&clock);
+    write_all(output->fd, bytes, length);
+    stage_end(output->stats, &clock, length);
+}
+
+void output_flush(output_buffer_t *output)
+{
+    output_write(output, output->data, output->length);
+    output->length = 0;
+}
+
+void output_reserve(output_buffer_t *output, size_t length)
+{
+    size_t capacity = output->capacity ? output->capacity : OUTPUT_BUFFER_SIZE;
+
+    if (output->length + length <= output->capacity)
+        return;
+
+    if (output->fd >= 0) {
+        output_flush(output);
+        return;
+    }
+
+    /* The caller's memory cannot grow, and the stream only feeds it what fits. Should it not, the
+     * output of the call is lost and the call fails, rather than the process. */
+    if (output->fd == OUTPUT_FIXED) {
+        output->overflow = true;
+        output->length = 0;
+        return;
+    }
+
+    /* Memory buffers grow instead. */
+    while (output->length + length > capacity)
+        capacity *= 2;
+    output->data = realloc(output->data, capacity);
+    if (!output->data) {
+        fwprintf(stderr, L"Out of memory\n");
+        exit(2);
+    }
+    output->capacity = capacity;
+}
+
+void output_append(output_buffer_t *output, const void *bytes, size_t length)
+{
+    /* Too big to ever fit, write it out directly. */
+    if (output->fd >= 0 && length > output->capacity) {
+        output_flush(output);
+        output_write(output, bytes, length);
+        return;
+    }
+
+    output_reserve(output, length);
+
+    memcpy(output->data + output->length, bytes, length);
+    output->length += length;
+}
+
+uint64_t clock_ns(clockid_t clock_id)
+{
+    struct timespec now;
+
+    clock_gettime(clock_id, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void stage_begin(stage_clock_t *clock)
+{
+    clock->wall_ns = clock_ns(CLOCK_MONOTONIC);
+    clock->cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+void stage_end(stage_stats_t *stats, const stage_clock_t *clock, uint64_t bytes)
+{
+    stats->bytes += bytes;
+    stats->wall_ns += clock_ns(CLOCK_MONOTONIC) - clock->wall_ns;
+    stats->cpu_ns += clock_ns(CLOCK_THREAD_CPUTIME_ID) - clock->cpu_ns;
+}
+
+const pattern_t *get_pattern(flag_type_t flag_type)
+{
+    switch (flag_type) {
+        case FLAG_TYPE_RAINBOW:
+            return &rainbow;
+
+        case FLAG_TYPE_TRANS:
+            return &transgender;
+
+        case FLAG_TYPE_NB:
+            return &nonbinary;
+
+        case FLAG_TYPE_LESBIAN:
+            return &lesbian;
+
+        case FLAG_TYPE_GAY:
+            return &gay;
+
+        case FLAG_TYPE_PAN:
+            return &pansexual;
+
+        case FLAG_TYPE_BI:
+            return &bisexual;
+
+        case FLAG_TYPE_GENDERFLUID:
+            return &gender_fluid;
+
+        case FLAG_TYPE_ASEXUAL:
+            return &asexual;
+
+        case FLAG_TYPE_UNLABELED:
+            return &unlabeled;
+
+        default:
+            return NULL;
+    }
+}
+
+static void mix_colors(uint32_t color1, uint32_t color2, float balance, float factor, color_t *output_color)
+{
+    uint8_t red_1   = (color1 & 0xff0000) >> 16;
+    uint8_t green_1 = (color1 & 0x00ff00) >>  8;
+    uint8_t blue_1  = (color1 & 0x0000ff) >>  0;
+
+    uint8_t red_2   = (color2 & 0xff0000) >> 16;
+    uint8_t green_2 = (color2 & 0x00ff00) >>  8;
+    uint8_t blue_2  = (color2 & 0x0000ff) >>  0;
+
+    balance = pow(balance, factor);
+
+    output_color->red = lrintf(red_1 * balance + red_2 * (1.0f - balance));
+    output_color->green = lrintf(green_1 * balance + green_2 * (1.0f - balance));
+    output_color->blue = lrintf(blue_1 * balance + blue_2 * (1.0f - balance));
+}
+
+void get_color_rainbow (const color_pattern_t *color_pattern, float theta, color_t *color)
+{
+    /* Unused variables. */
+    UNUSED(color_pattern);
+
+    /* Get theta in range. */
+    while (theta < 0) theta += 2.0f * (float)M_PI;
+    while (theta >= 2.0f * (float)M_PI) theta -= 2.0f * (float)M_PI;
+
+    /* Generate the color. */
+    color->red   = lrintf((1.0f * (0.5f + 0.5f * sin(theta + 0            ))) * 255.0f);
+    color->green = lrintf((1.0f * (0.5f + 0.5f * sin(theta + 2 * M_PI / 3 ))) * 255.0f);
+    color->blue  = lrintf((1.0f * (0.5f + 0.5f * sin(theta + 4 * M_PI / 3 ))) * 255.0f);
+}
+
+void get_color_stripes (const color_pattern_t *color_pattern, float theta, color_t *color)
+{
+    /* Get theta in range. */
+    while (theta < 0) theta += 2.0f * (float)M_PI;
+    while (theta >= 2.0f * (float)M_PI) theta -= 2.0f * (float)M_PI;
+
+    /* Find the stripe based on theta and generate the color. */
+    for (int i = 0; i < color_pattern->stripes_count; i++) {
+        float stripe_size = (2.0f * M_PI) / color_pattern->stripes_count;
+        float min_theta = i * stripe_size;
+        float max_theta = (i + 1) * stripe_size;
+
+        if (min_theta <= theta && max_theta > theta) {
+            float balance = 1 - ((theta - min_theta) / stripe_size);
+            mix_colors(
+                    color_pattern->stripes_colors[i],
+                    NEXT_CYCLIC_ELEMENT(color_pattern->stripes_colors, i, color_pattern->stripes_count),
+                    balance,
+                    color_pattern->factor,
+                    color);
+            return;
+        }
+    }
+}
+
+void build_gradient(const pattern_t *pattern, gradient_t *gradient)
+{
+    for (int i = 0; i < GRADIENT_SIZE; i++) {
+        color_t *color = &gradient->colors[i];
+        float theta = i * (2.0f * (float)M_PI) / GRADIENT_SIZE;
+
+        pattern->get_color(&pattern->color_pattern, theta, color);
+        set_escape_code(&gradient->escape_codes[i], "\033[38;2;%d;%d;%dm", color->red, color->green, color->blue);
+        gradient->ansii_codes[i] = quantize_color(color);
+    }
+}
+
+void build_ansii_escape_codes(escape_code_t escape_codes[ANSII_CODES_COUNT])
+{
+    for (int code = 0; code < ANSII_CODES_COUNT; code++)
+        set_escape_code(&escape_codes[code], "\033[38;5;%dm", code);
+}
+
+ansii_code_t quantize_color(const color_t *color)
+{
+    return palette_nearest[color->red >> (8 - PALETTE_CELL_BITS)][color->green >> (8 - PALETTE_CELL_BITS)][color->blue >> (8 - PALETTE_CELL_BITS)];
+}
+
+float color_distance_squared(const color_t *color1, const color_t *color2)
+{
+    /* "Redmean" weighted distance, a cheap approximation of perceived difference. */
+    float mean_red = (color1->red + color2->red) / 2.0f;
+    float red = color1->red - color2->red;
+    float green = color1->green - color2->green;
+    float blue = color1->blue - color2->blue;
+
+    return (2.0f + mean_red / 256.0f) * red * red
+           + 4.0f * green * green
+           + (2.0f + (255.0f - mean_red) / 256.0f) * blue * blue;
+}
+
+static void set_escape_code(escape_code_t *escape_code, const char *format, ...)
+{
+    char bytes[MAX_ESCAPE_CODE_LENGTH];
+    va_list arguments;
+
+    va_start(arguments, format);
+    escape_code->length = vsnprintf(bytes, sizeof(bytes), format, arguments);
+    va_end(arguments);
+    memcpy(escape_code->bytes, bytes, escape_code->length);
+}
+
+static uint32_t phase_from_periods(double periods)
+{
+    /* Only the fraction of a period matters, negative ones wrap around. */
+    return (uint32_t)(int64_t)llround(fmod(periods, 1.0) * 4294967296.0);
+}
+
+static void layout_open_cell(colorizer_t *colorizer)
+{
+    layout_t *layout = colorizer->layout;
+
+    if (layout->cells_count == layout->cells_capacity) {
+        layout->cells_capacity = layout->cells_capacity ? 2 * layout->cells_capacity : 1024;
+        layout->cells = realloc(layout->cells, layout->cells_capacity * sizeof(layout_cell_t));
+        if (!layout->cells) {
+            fwprintf(stderr, L"Out of memory\n");
+            exit(2);
+        }
+    }
+
+    layout->cells[layout->cells_count++] = (layout_cell_t){
+        .phase = colorizer->phase,
+        .line = colorizer->line_index,
+        .column = layout->column,
+        .width = colorizer->grapheme.width,
+        .offset = colorizer->output->length
+    };
+    layout->cell_open = true;
+}
+
+static void layout_close_cell(colorizer_t *colorizer)
+{
+    layout_t *layout = colorizer->layout;
+    layout_cell_t *cell;
+
+    /* No cell is open before the first one, an empty input has none. */
+    if (!layout->cell_open || !layout->cells_count)
+        return;
+    cell = &layout->cells[layout->cells_count - 1];
+    cell->length = colorizer->output->length - cell->offset;
+    layout->cell_open = false;
+}
+
+static void layout_advance(colorizer_t *colorizer, wint_t current_char, int width)
+{
+    layout_t *layout = colorizer->layout;
+
+    /* Tab stops are every 8 columns, as terminals set them by default. */
+    if (current_char == '\n' || current_char == '\r')
+        layout->column = 0;
+    else if (current_char == '\t')
+        layout->column = (layout->column / 8 + 1) * 8;
+    else
+        layout->column += width;
+}
+
+static ALWAYS_INLINE void print_color(colorizer_t *colorizer, kernel_type_t kernel_type)
+{
+    emitter_t *emitter = &colorizer->emitter;
+    output_buffer_t *output = colorizer->output;
+    const escape_code_t *escape_code;
+
+    if (kernel_type == KERNEL_TYPE_LAYOUT) {
+        layout_open_cell(colorizer);
+        return;
+    } else if (kernel_type == KERNEL_TYPE_ANSII) {
+        /* A period goes through every code once. */
+        unsigned int codes_count = colorizer->ansii_codes_count;
+        unsigned int index = (colorizer->ansii_base + (unsigned int)(((uint64_t)colorizer->phase * codes_count) >> 32)) % codes_count;
+        ansii_code_t code = colorizer->ansii_codes[index];
+
+        /* Skip the escape if the terminal already shows this color. */
+        if (emitter->valid && emitter->code == code) {
+            colorizer->stats.colors_suppressed++;
+            return;
+        }
+
+        emitter->code = code;
+        escape_code = &colorizer->ansii_escape_codes[code];
+    } else if (kernel_type == KERNEL_TYPE_ANSII_GRADIENT) {
+        /* The gradient entry nearest to the phase, as its nearest ANSI code. */
+        uint32_t index = (uint32_t)(colorizer->phase + (1u << (31 - GRADIENT_BITS))) >> (32 - GRADIENT_BITS);
+        ansii_code_t code = colorizer->gradient->ansii_codes[index];
+
+        if (emitter->valid && emitter->code == code) {
+            colorizer->stats.colors_suppressed++;
+            return;
+        }
+
+        emitter->code = code;
+        escape_code = &colorizer->ansii_escape_codes[code];
+    } else if (kernel_type == KERNEL_TYPE_HTML) {
+        /* The class of the gradient entries nearest to the phase. */
+        unsigned int class_index = (uint32_t)(colorizer->phase + (1u << (31 - HTML_CLASS_BITS))) >> (32 - HTML_CLASS_BITS);
+
+        /* Runs of a class stay in one span, a new span ends the last one. */
+        if (emitter->valid && emitter->code == class_index) {
+            colorizer->stats.colors_suppressed++;
+            return;
+        }
+        if (emitter->valid) {
+            output_append(output, HTML_SPAN_END, strlen(HTML_SPAN_END));
+            colorizer->stats.escape_bytes += strlen(HTML_SPAN_END);
+        }
+
+        emitter->code = class_index;
+        escape_code = &colorizer->html_span_codes[class_index];
+    } else {
+        /* Look the color up in the gradient, at the nearest entry to the phase. */
+        uint32_t index = (uint32_t)(colorizer->phase + (1u << (31 - GRADIENT_BITS))) >> (32 - GRADIENT_BITS);
+        const color_t *color = &colorizer->gradient->colors[index];
+
+        /* Skip the escape if the terminal already shows this color, or one too close to tell apart. */
+        if (kernel_type == KERNEL_TYPE_24_BIT_THRESHOLD) {
+            if (emitter->valid && color_distance_squared(&emitter->color, color) <= colorizer->threshold_squared) {
+                colorizer->stats.colors_suppressed++;
+                return;
+            }
+        } else if (emitter->valid && emitter->color.red == color->red && emitter->color.green == color->green
+                   && emitter->color.blue == color->blue) {
+            colorizer->stats.colors_suppressed++;
+            return;
+        }
+
+        emitter->color = *color;
+        escape_code = &colorizer->gradient->escape_codes[index];
+    }
+
+    emitter->valid = true;
+    colorizer->stats.colors_emitted++;
+    colorizer->stats.escape_bytes += escape_code->length;
+
+    if (colorizer->first_escape_pending) {
+        colorizer->first_escape_pending = false;
+        colorizer->first_escape_offset = output->length;
+        colorizer->first_escape_length = escape_code->length;
+        colorizer->first_emitter = *emitter;
+    }
+
+    /* Copy the whole array, a fixed size copy is a few moves. Only the escape code is kept. */
+    output_reserve(output, sizeof(escape_code->bytes));
+    memcpy(output->data + output->length, escape_code->bytes, sizeof(escape_code->bytes));
+    output->length += escape_code->length;
+}
+
+static ALWAYS_INLINE void append_html_char(output_buffer_t *output, uint8_t byte)
+{
+    /* Only these would be read as markup inside a <pre>. */
+    if (byte == '<')
+        output_append(output, "&lt;", strlen("&lt;"));
+    else if (byte == '>')
+        output_append(output, "&gt;", strlen("&gt;"));
+    else if (byte == '&')
+        output_append(output, "&amp;", strlen("&amp;"));
+    else
+        output->data[output->length++] = byte;
+}
+
+static ALWAYS_INLINE void colorize_ascii_run(colorizer_t *colorizer, const uint8_t *run, size_t length, kernel_type_t kernel_type)
+{
+    output_buffer_t *output = colorizer->output;
+
+    /* Every char here is one column wide and outside of any escape sequence. */
+    colorizer->stats.chars += length;
+    for (size_t i = 0; i < length; i++) {
+        output_reserve(output, MAX_CHAR_OUTPUT_LENGTH);
+
+        colorizer->phase += colorizer->column_step;
+        if (kernel_type == KERNEL_TYPE_LAYOUT) {
+            layout_close_cell(colorizer);
+            colorizer->grapheme.width = 1;
+        }
+        if (run[i] != ' ')
+            print_color(colorizer, kernel_type);
+        if (kernel_type == KERNEL_TYPE_HTML)
+            append_html_char(output, run[i]);
+        else
+            output->data[output->length++] = run[i];
+        if (kernel_type == KERNEL_TYPE_LAYOUT)
+            colorizer->layout->column++;
+    }
+
+    colorizer->escape_state = ESCAPE_STATE_OUT;
+    colorizer->grapheme = (grapheme_state_t){ .previous_class = GRAPHEME_CLASS_OTHER, .width = 1 };
+}
+
+static ALWAYS_INLINE size_t colorize_block_kernel(colorizer_t *colorizer, const uint8_t *block, size_t length, bool final,
+                                                  kernel_type_t kernel_type)
+{
+    size_t position = 0;
+
+    while (position < length) {
+        wint_t current_char;
+
+        /* Copy escape sequences through whole, never coloring inside them. */
+        if (IS_IN_ESCAPE(colorizer->escape_state) || block[position] == ESCAPE_CHAR) {
+            size_t sequence_length = scan_escape_sequence(block + position, length - position, &colorizer->escape_state);
+            if (kernel_type == KERNEL_TYPE_LAYOUT)
+                layout_close_cell(colorizer);
+
+            /* A browser would show them as text, drop them. Our span goes on. */
+            if (kernel_type == KERNEL_TYPE_HTML) {
+                position += sequence_length;
+                if (colorizer->escape_state == ESCAPE_STATE_LAST) {
+                    colorizer->stats.escape_sequences++;
+                    colorizer->grapheme = (grapheme_state_t){ 0 };
+                }
+                continue;
+            }
+            output_append(colorizer->output, block + position, sequence_length);
+            position += sequence_length;
+
+            /* The sequence may have changed the color, send ours again before the next char. */
+            if (colorizer->escape_state == ESCAPE_STATE_LAST) {
+                colorizer->stats.escape_sequences++;
+                colorizer->emitter.valid = false;
+                colorizer->first_escape_pending = false;
+                colorizer->escape_length = 0;
+                colorizer->grapheme = (grapheme_state_t){ 0 };
+            } else {
+                colorizer->escape_length += sequence_length;
+            }
+            continue;
+        }
+
+        /* Color plain ASCII in bulk, the scalar path below only handles what stops the scan. */
+        size_t run_length = colorizer->scan_ascii(block + position, length - position);
+        if (run_length) {
+            colorize_ascii_run(colorizer, block + position, run_length, kernel_type);
+            position += run_length;
+            continue;
+        }
+
+        size_t char_length = utf8_decode(block + position, length - position, &current_char);
+
+        /* Keep a partial sequence for the next block, unless there is none. */
+        if (char_length == 0) {
+            if (!final)
+                break;
+            current_char = UTF8_INVALID;
+            char_length = 1;
+        }
+
+        colorizer->stats.chars++;
+        colorizer->stats.invalid_bytes += current_char == UTF8_INVALID;
+
+        grapheme_state_t *grapheme = &colorizer->grapheme;
+        uint8_t properties = (current_char == UTF8_INVALID) ? UNICODE_PROPERTIES(1, GRAPHEME_CLASS_OTHER, false)
+                             : unicode_lookup(current_char);
+        grapheme_class_t grapheme_class = UNICODE_CLASS(properties);
+        int width = UNICODE_WIDTH(properties);
+
+        colorizer->escape_state = ESCAPE_STATE_OUT;
+
+        /* Handle newlines. */
+        if (current_char == '\n') {
+            colorizer->line_index++;
+            colorizer->line_phase += colorizer->line_step;
+            colorizer->phase = colorizer->line_phase;
+            if (kernel_type == KERNEL_TYPE_LAYOUT) {
+                layout_close_cell(colorizer);
+                layout_advance(colorizer, current_char, 0);
+            }
+
+            /* Spans end with their line, so that lines (and chunks colored ahead) stand alone. */
+            if (kernel_type == KERNEL_TYPE_HTML && colorizer->emitter.valid) {
+                output_append(colorizer->output, HTML_SPAN_END, strlen(HTML_SPAN_END));
+                colorizer->stats.escape_bytes += strlen(HTML_SPAN_END);
+                colorizer->emitter.valid = false;
+            }
+        } else if (is_grapheme_break(grapheme, grapheme_class)) {
+            colorizer->phase += (uint32_t)width * colorizer->column_step;
+            grapheme->width = width;
+            if (kernel_type == KERNEL_TYPE_LAYOUT)
+                layout_close_cell(colorizer);
+
+            /* One color per cluster. Whitespace and controls would not show it, leave it for the next one. */
+            if (!UNICODE_IS_SPACE(properties) && grapheme_class > GRAPHEME_CLASS_LF)
+                print_color(colorizer, kernel_type);
+            if (kernel_type == KERNEL_TYPE_LAYOUT)
+                layout_advance(colorizer, current_char, width);
+        } else if (width > grapheme->width) {
+            /* The cluster is as wide as its widest char. */
+            colorizer->phase += (uint32_t)(width - grapheme->width) * colorizer->column_step;
+            if (kernel_type == KERNEL_TYPE_LAYOUT) {
+                layout_advance(colorizer, current_char, width - grapheme->width);
+                if (colorizer->layout->cell_open)
+                    colorizer->layout->cells[colorizer->layout->cells_count - 1].width = width;
+            }
+            grapheme->width = width;
+        }
+        advance_grapheme(grapheme, grapheme_class);
+
+        /* Print the char, as it was in the input. Invalid bytes would make the whole HTML invalid. */
+        if (kernel_type == KERNEL_TYPE_HTML && current_char == UTF8_INVALID)
+            output_append(colorizer->output, UTF8_REPLACEMENT_CHAR, strlen(UTF8_REPLACEMENT_CHAR));
+        else
+            output_append(colorizer->output, block + position, char_length);
+        position += char_length;
+    }
+
+    return position;
+}
+
+static size_t colorize_block_plain(colorizer_t *colorizer, const uint8_t *block, size_t length, bool final)
+{
+    size_t end = length;
+    wint_t last_char;
+
+    /* Without colors the output is the input, only a char cut by the end of the block waits. */
+    for (size_t i = 1; !final && i <= UTF8_MAX_LENGTH && i <= length; i++) {
+        if ((block[length - i] & 0xc0) != 0x80) {
+            if (utf8_decode(block + length - i, i, &last_char) == 0)
+                end = length - i;
+            break;
+        }
+    }
+
+    /* Count chars by their first byte, invalid ones are not told apart here. */
+    for (size_t i = 0; i < end; i++)
+        colorizer->stats.chars += (block[i] & 0xc0) != 0x80;
+
+    output_append(colorizer->output, block, end);
+    return end;
+}
+
+static size_t colorize_block_ansii(colorizer_t *colorizer, const uint8_t *block, size_t length, bool final)
+{
+    return colorize_block_kernel(colorizer, block, length, final, KERNEL_TYPE_ANSII);
+}
+
+static size_t colorize_block_ansii_gradient(colorizer_t *colorizer, const uint8_t *block, size_t length, bool final)
+{
+    return colorize_block_kernel(colorizer, block, length, final, KERNEL_TYPE_ANSII_GRADIENT);
+}
+
+static size_t colorize_block_24_bit(colorizer_t *colorizer, const uint8_t *block, size_t length, bool final)
+{
+    return colorize_block_kernel(colorizer, block, length, final, KERNEL_TYPE_24_BIT);
+}
+
+static size_t colorize_block_24_bit_threshold(colorizer_t *colorizer, const uint8_t *block, size_t length, bool final)
+{
+    return colorize_block_kernel(colorizer, block, length, final, KERNEL_TYPE_24_BIT_THRESHOLD);
+}
+
+static size_t colorize_block_html(colorizer_t *colorizer, const uint8_t *block, size_t length, bool final)
+{
+    if (colorizer->html_style_pending)
+        write_html_style(colorizer);
+    return colorize_block_kernel(colorizer, block, length, final, KERNEL_TYPE_HTML);
+}
+
+static size_t colorize_block_layout(colorizer_t *colorizer, const uint8_t *block, size_t length, bool final)
+{
+    return colorize_block_kernel(colorizer, block, length, final, KERNEL_TYPE_LAYOUT);
+}
+
+size_t colorize_block(colorizer_t *colorizer, const uint8_t *block, size_t length, bool final)
+{
+    return colorizer->kernel->colorize_block(colorizer, block, length, final);
+}
+
+void write_html_style(colorizer_t *colorizer)
+{
+    output_buffer_t *output = colorizer->output;
+    size_t start = output->length;
+
+    /* A class per color, spans then only name it. */
+    output_reserve(output, MAX_HTML_STYLE_LENGTH);
+    output->length += sprintf(output->data + output->length, "<style>");
+    for (int class_index = 0; class_index < HTML_CLASSES_COUNT; class_index++) {
+        const color_t *color = &colorizer->gradient->colors[class_index << (GRADIENT_BITS - HTML_CLASS_BITS)];
+
+        output->length += sprintf(output->data + output->length, ".qc%d{color:#%02x%02x%02x}", class_index,
+                                  color->red, color->green, color->blue);
+    }
+    output->length += sprintf(output->data + output->length, "</style>");
+
+    colorizer->stats.escape_bytes += output->length - start;
+    colorizer->html_style_pending = false;
+}
+
+/* *** Layout ********************************************************/
+void layout_text(colorizer_t *colorizer, layout_t *layout, const uint8_t *text, size_t length)
+{
+    const kernel_t *kernel = colorizer->kernel;
+    output_buffer_t *output = colorizer->output;
+
+    /* Run the layout kernel from where the colorizer is, the text goes to the layout. */
+    layout->text.fd = OUTPUT_GROWABLE;
+    colorizer->kernel = &kernels[KERNEL_TYPE_LAYOUT];
+    colorizer->output = &layout->text;
+    colorizer->layout = layout;
+
+    colorize_block(colorizer, text, length, true);
+    layout_close_cell(colorizer);
+
+    colorizer->kernel = kernel;
+    colorizer->output = output;
+    colorizer->layout = NULL;
+}
+
+void layout_free(layout_t *layout)
+{
+    free(layout->text.data);
+    free(layout->cells);
+}
+
+const escape_code_t *color_at_phase(const colorizer_t *colorizer, uint32_t phase, uint32_t *key)
+{
+    /* Same lookups as print_color, the key is the ANSI code or the 24-bit color. */
+    if (colorizer->color_type == COLOR_TYPE_ANSII) {
+        unsigned int codes_count = colorizer->ansii_codes_count;
+        unsigned int index = (colorizer->ansii_base + (unsigned int)(((uint64_t)phase * codes_count) >> 32)) % codes_count;
+
+        *key = colorizer->ansii_codes[index];
+        return &colorizer->ansii_escape_codes[*key];
+    }
+
+    uint32_t index = (uint32_t)(phase + (1u << (31 - GRADIENT_BITS))) >> (32 - GRADIENT_BITS);
+    if (colorizer->color_type == COLOR_TYPE_ANSII_GRADIENT) {
+        *key = colorizer->gradient->ansii_codes[index];
+        return &colorizer->ansii_escape_codes[*key];
+    }
+
+    const color_t *color = &colorizer->gradient->colors[index];
+    *key = ((uint32_t)color->red << 16) | ((uint32_t)color->green << 8) | color->blue;
+    return &colorizer->gradient->escape_codes[index];
+}
+
+/* *** Stream ********************************************************/
+void queercat_options_init(queercat_options_t *options)
+{
+    *options = (queercat_options_t){
+        .flag_type = FLAG_TYPE_RAINBOW,
+        .color_type = COLOR_TYPE_ANSII,
+        .print_colors = true,
+        .freq_h = 0.23,
+        .freq_v = 0.1,
+    };
+}
+
+queercat_stream_t *queercat_stream_new(const queercat_options_t *options)
+{
+    const pattern_t *pattern = options->flag ? &options->flag->pattern : get_pattern(options->flag_type);
+    color_type_t color_type = options->color_type;
+    queercat_stream_t *stream;
+
+    if (!pattern || color_type <= COLOR_TYPE_INVALID || color_type >= COLOR_TYPE_COUNT) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* Flags without ANSI codes of their own get them from the gradient. */
+    if (color_type == COLOR_TYPE_ANSII && !pattern->ansii_pattern.codes_count)
+        color_type = COLOR_TYPE_ANSII_GRADIENT;
+
+    stream = calloc(1, sizeof(*stream));
+    if (!stream)
+        return NULL;
+
+    /* Sample the pattern once, unless it was compiled ahead. 24-bit colors and all escape codes are then looked up. */
+    stream->colorizer.gradient = &stream->gradient;
+    if (color_type != COLOR_TYPE_ANSII && options->flag && options->flag->gradient)
+        stream->colorizer.gradient = options->flag->gradient;
+    else if (color_type != COLOR_TYPE_ANSII)
+        build_gradient(pattern, &stream->gradient);
+    if (color_type == COLOR_TYPE_ANSII || color_type == COLOR_TYPE_ANSII_GRADIENT)
+        build_ansii_escape_codes(stream->ansii_escape_codes);
+    if (color_type == COLOR_TYPE_HTML) {
+        for (int class_index = 0; class_index < HTML_CLASSES_COUNT; class_index++)
+            set_escape_code(&stream->html_span_codes[class_index], "<span class=qc%d>", class_index);
+    }
+
+    stream->colorizer.ansii_codes = pattern->ansii_pattern.ansii_codes;
+    stream->colorizer.ansii_codes_count = pattern->ansii_pattern.codes_count;
+    stream->colorizer.ansii_escape_codes = stream->ansii_escape_codes;
+    stream->colorizer.html_span_codes = stream->html_span_codes;
+    stream->colorizer.html_style_pending = color_type == COLOR_TYPE_HTML;
+    stream->colorizer.color_type = color_type;
+    stream->colorizer.print_colors = options->print_colors || color_type == COLOR_TYPE_HTML;
+    stream->colorizer.threshold_squared = options->threshold * options->threshold;
+    stream->colorizer.scan_ascii = select_scan_ascii();
+    stream->colorizer.output = &stream->output;
+
+    /* The frequencies are in radians for gradients, and in codes for ANSI ones. */
+    if (color_type != COLOR_TYPE_ANSII) {
+        stream->colorizer.column_step = phase_from_periods(options->freq_h / 5.0 / (2.0 * M_PI));
+        stream->colorizer.line_step = phase_from_periods(options->freq_v / (2.0 * M_PI));
+        stream->colorizer.line_phase = phase_from_periods((options->offx + 2.0 * options->rand_offset / RAND_MAX) / 2.0);
+    } else {
+        long codes_count = pattern->ansii_pattern.codes_count;
+        long base = ((long)floor(options->offx * codes_count) + options->rand_offset % codes_count) % codes_count;
+
+        stream->colorizer.column_step = phase_from_periods(options->freq_h / codes_count);
+        stream->colorizer.line_step = phase_from_periods(options->freq_v / codes_count);
+        stream->colorizer.ansii_base = (base < 0) ? base + codes_count : base;
+    }
+    stream->colorizer.phase = stream->colorizer.line_phase;
+    stream->output.fd = OUTPUT_FIXED;
+
+    /* Pick the block loop once, with no choice left to make per char. */
+    if (color_type == COLOR_TYPE_HTML)
+        stream->colorizer.kernel = &kernels[KERNEL_TYPE_HTML];
+    else if (!options->print_colors)
+        stream->colorizer.kernel = &kernels[KERNEL_TYPE_PLAIN];
+    else if (color_type == COLOR_TYPE_ANSII)
+        stream->colorizer.kernel = &kernels[KERNEL_TYPE_ANSII];
+    else if (color_type == COLOR_TYPE_ANSII_GRADIENT)
+        stream->colorizer.kernel = &kernels[KERNEL_TYPE_ANSII_GRADIENT];
+    else if (options->threshold > 0)
+        stream->colorizer.kernel = &kernels[KERNEL_TYPE_24_BIT_THRESHOLD];
+    else
+        stream->colorizer.kernel = &kernels[KERNEL_TYPE_24_BIT];
+
+    return stream;
+}
+
+void queercat_stream_free(queercat_stream_t *stream)
+{
+    free(stream);
+}
+
+size_t queercat_output_bound(size_t input_length)
+{
+    /* Each char, including those held back from the last call, gets at most one escape. The first
+     * output of an HTML stream also has the stylesheet, and its flush ends a span. */
+    return (input_length + UTF8_MAX_LENGTH) * MAX_CHAR_OUTPUT_LENGTH + MAX_HTML_STYLE_LENGTH + strlen(HTML_SPAN_END);
+}
+
+static size_t input_fitting(size_t output_size)
+{
+    /* The most input that queercat_output_bound says always fits. */
+    size_t fixed = queercat_output_bound(0);
+
+    return (output_size < fixed) ? 0 : (output_size - fixed) / MAX_CHAR_OUTPUT_LENGTH;
+}
+
+static void stream_feed_piece(queercat_stream_t *stream, const uint8_t *bytes, size_t input_length)
+{
+    size_t consumed;
+
+    /* Complete the char cut by the end of the last input first. */
+    while (stream->carry_length) {
+        size_t taken = UTF8_MAX_LENGTH - stream->carry_length;
+        if (taken > input_length)
+            taken = input_length;
+        memcpy(stream->carry + stream->carry_length, bytes, taken);
+
+        consumed = colorize_block(&stream->colorizer, stream->carry, stream->carry_length + taken, false);
+        if (consumed == 0) {
+            /* Still cut, the input was too short to complete it. */
+            stream->carry_length += taken;
+            return;
+        } else if (consumed >= stream->carry_length) {
+            bytes += consumed - stream->carry_length;
+            input_length -= consumed - stream->carry_length;
+            stream->carry_length = 0;
+        } else {
+            /* Invalid bytes went through one by one, retry with what is left. */
+            stream->carry_length -= consumed;
+            memmove(stream->carry, stream->carry + consumed, stream->carry_length);
+        }
+    }
+
+    consumed = colorize_block(&stream->colorizer, bytes, input_length, false);
+    stream->carry_length = input_length - consumed;
+    memcpy(stream->carry, bytes + consumed, stream->carry_length);
+}
+
+ssize_t queercat_stream_feed(queercat_stream_t *stream, const void *input, size_t input_length, void *output, size_t output_size,
+                             size_t *consumed)
+{
+    const uint8_t *bytes = input;
+    size_t taken = 0;
+
+    if (!consumed && output_size < queercat_output_bound(input_length)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    stream->output.data = output;
+    stream->output.capacity = output_size;
+    stream->output.length = 0;
+    stream->output.overflow = false;
+
+    /* Take the input in pieces whose output surely fits in the room left, a single piece when
+     * the whole input does. */
+    while (taken < input_length) {
+        size_t piece = input_fitting(output_size - stream->output.length);
+
+        if (piece == 0)
+            break;
+        if (piece > input_length - taken)
+            piece = input_length - taken;
+        stream_feed_piece(stream, bytes + taken, piece);
+        taken += piece;
+    }
+
+    if (stream->output.overflow) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    if (consumed)
+        *consumed = taken;
+    return stream->output.length;
+}
+
+ssize_t queercat_stream_flush(queercat_stream_t *stream, void *output, size_t output_size)
+{
+    colorizer_t *colorizer = &stream->colorizer;
+
+    if (output_size < queercat_output_bound(0)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    stream->output.data = output;
+    stream->output.capacity = output_size;
+    stream->output.length = 0;
+    stream->output.overflow = false;
+
+    /* A char still cut at the end of the input is passed through as invalid bytes. */
+    colorize_block(colorizer, stream->carry, stream->carry_length, true);
+    stream->carry_length = 0;
+
+    if (colorizer->color_type == COLOR_TYPE_HTML) {
+        if (colorizer->emitter.valid) {
+            output_append(&stream->output, HTML_SPAN_END, strlen(HTML_SPAN_END));
+            colorizer->stats.escape_bytes += strlen(HTML_SPAN_END);
+        }
+    } else if (colorizer->print_colors) {
+        output_append(&stream->output, RESET_ESCAPE_CODE, strlen(RESET_ESCAPE_CODE));
+        colorizer->stats.escape_bytes += strlen(RESET_ESCAPE_CODE);
+    }
+
+    colorizer->emitter.valid = false;
+    colorizer->escape_state = ESCAPE_STATE_OUT;
+    colorizer->escape_length = 0;
+    colorizer->grapheme = (grapheme_state_t){ 0 };
+
+    if (stream->output.overflow) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    return stream->output.length;
+}
+
+size_t queercat_stream_pending_escape(const queercat_stream_t *stream)
+{
+    return stream->colorizer.escape_length;
+}
+
+void queercat_stream_stats(const queercat_stream_t *stream, queercat_stats_t *stats)
+{
+    *stats = stream->colorizer.stats;
+}
+
+const char *queercat_stream_kernel(const queercat_stream_t *stream)
+{
+    return stream->colorizer.kernel->name;
+}
@@ -0,0 +1,128 @@
+#ifndef QUEERCAT_H
+#define QUEERCAT_H
+
+/* *** Includes ******************************************************/
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+/* *** Types *********************************************************/
+/* Color type patterns. */
+typedef enum color_type_e {
+    COLOR_TYPE_INVALID = -1,
+    COLOR_TYPE_ANSII = 0,
+    COLOR_TYPE_24_BIT,
+    COLOR_TYPE_ANSII_GRADIENT,  /* The 24-bit gradient, in the nearest ANSI 256 colors. */
+    COLOR_TYPE_HTML,            /* HTML spans of CSS classes, always colored. */
+    COLOR_TYPE_COUNT
+} color_type_t;
+
+/* Patterns enum. */
+typedef enum flag_type_e
+{
+    FLAG_TYPE_INVALID = -1,
+    FLAG_TYPE_RAINBOW = 0,
+    FLAG_TYPE_TRANS,
+    FLAG_TYPE_NB,
+    FLAG_TYPE_LESBIAN,
+    FLAG_TYPE_GAY,
+    FLAG_TYPE_PAN,
+    FLAG_TYPE_BI,
+    FLAG_TYPE_GENDERFLUID,
+    FLAG_TYPE_ASEXUAL,
+    FLAG_TYPE_UNLABELED,
+    FLAG_TYPE_END
+} flag_type_t;
+
+/* Flag of a registry, and the registry holding the built-in flags and those of config files. */
+typedef struct queercat_flag_s queercat_flag_t;
+typedef struct queercat_registry_s queercat_registry_t;
+
+/* Stream options, see queercat_options_init for the defaults. */
+typedef struct queercat_options_s {
+    flag_type_t flag_type;
+    const queercat_flag_t *flag;  /* Used instead of flag_type when set. */
+    color_type_t color_type;
+    bool print_colors;
+    double freq_h;
+    double freq_v;
+    double offx;
+    int rand_offset;
+    double threshold;
+} queercat_options_t;
+
+/* Colorizing stream, holds the position, escape state and color on screen between calls. */
+typedef struct queercat_stream_s queercat_stream_t;
+
+/* Counters of a stream since it was created. */
+typedef struct queercat_stats_s {
+    uint64_t chars;              /* Chars seen, invalid bytes included. */
+    uint64_t invalid_bytes;      /* Bytes that were not valid UTF-8. */
+    uint64_t escape_bytes;       /* Output bytes of the color and reset escapes. */
+    uint64_t colors_emitted;
+    uint64_t colors_suppressed;  /* Already on screen, or too close to it. */
+    uint64_t escape_sequences;   /* Escape sequences of the input, passed through. */
+} queercat_stats_t;
+
+
+/* *** Functions Declarations ****************************************/
+/* Fill in the defaults: rainbow, ANSI colors, frequencies 0.23 and 0.1, no offset. */
+void queercat_options_init(queercat_options_t *options);
+
+/* Create a registry of the built-in flags, returns NULL on failure. It must outlive the streams
+ * using its flags. */
+queercat_registry_t *queercat_registry_new(void);
+void queercat_registry_free(queercat_registry_t *registry);
+
+/* Add the flags of a config file, replacing flags of the same name. Each "[name]" section sets
+ * "stripes" (hex colors), "factor" (stripe blending, default 4) and optionally "ansi" (ANSI codes,
+ * without them ANSI colors come from the gradient).
+ * The compiled flags are cached in cache_path (if not NULL), reused while the config is unchanged.
+ * Returns -1 and sets errno on failure, EINVAL for an invalid config with *error_line set. */
+int queercat_registry_load(queercat_registry_t *registry, const char *config_path, const char *cache_path, int *error_line);
+
+/* Compile the gradients of the flags that have none yet, so streams do not each sample their
+ * pattern. Returns -1 and sets errno on failure. */
+int queercat_registry_compile(queercat_registry_t *registry);
+
+/* Find a flag by name, or a built-in flag by its name in --help (trans, NB, pan, bi, genderfluid),
+ * returns NULL if there is none. */
+const queercat_flag_t *queercat_registry_find(const queercat_registry_t *registry, const char *name);
+
+/* Create a stream, returns NULL and sets errno on failure (EINVAL for invalid options).
+ * Input is UTF-8, colored one grapheme cluster at a time whatever the locale.
+ * HTML output starts with a stylesheet of a class per color, then spans of those classes that
+ * end with each line. The input's escape sequences are dropped, and the caller wraps the whole
+ * output in a <pre> element. */
+queercat_stream_t *queercat_stream_new(const queercat_options_t *options);
+void queercat_stream_free(queercat_stream_t *stream);
+
+/* Output buffer size that is always enough for feeding input_length bytes, or for a flush. */
+size_t queercat_output_bound(size_t input_length);
+
+/* Colorize input into output, returns the number of bytes written to output.
+ * A UTF-8 character or escape sequence may be split across calls. With consumed set, as much
+ * input is taken as surely fits in output_size and *consumed says how much: feed the rest again
+ * once the output is written out, any output_size of at least queercat_output_bound(1) takes
+ * some. With consumed NULL, fails with ENOBUFS unless output_size is at least
+ * queercat_output_bound(input_length). */
+ssize_t queercat_stream_feed(queercat_stream_t *stream, const void *input, size_t input_length, void *output, size_t output_size,
+                             size_t *consumed);
+
+/* End of an input: write out what was held back and reset the terminal colors.
+ * The stream can then be fed the next input, the line position carries on. */
+ssize_t queercat_stream_flush(queercat_stream_t *stream, void *output, size_t output_size);
+
+/* Number of bytes at the end of the output so far that belong to an escape sequence the input
+ * has not finished yet. Holding them back keeps a partial write from cutting the sequence. */
+size_t queercat_stream_pending_escape(const queercat_stream_t *stream);
+
+/* Counters of the stream so far. */
+void queercat_stream_stats(const queercat_stream_t *stream, queercat_stats_t *stats);
+
+/* Name of the coloring kernel picked for the stream options, for diagnostics. */
+const char *queercat_stream_kernel(const queercat_stream_t *stream);
+
+#endif /* QUEERCAT_H */
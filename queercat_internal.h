@@ -0,0 +1,277 @@
+#ifndef QUEERCAT_INTERNAL_H
+#define QUEERCAT_INTERNAL_H
+
+/* *** Includes ******************************************************/
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <wchar.h>
+#include "queercat.h"
+
+
+/* *** Common ********************************************************/
+/* Constants */
+#define NEWLINE '\n'
+#define ESCAPE_CHAR '\033'
+
+/* Types */
+/* ECMA-48 escape sequence states. LAST is the last byte of a sequence, then back to OUT. */
+typedef enum escape_state_e {
+    ESCAPE_STATE_OUT = 0,
+    ESCAPE_STATE_LAST,
+    ESCAPE_STATE_ESCAPE,          /* ESC */
+    ESCAPE_STATE_INTERMEDIATE,    /* ESC, intermediate bytes */
+    ESCAPE_STATE_CSI,             /* ESC [ */
+    ESCAPE_STATE_OSC,             /* ESC ], ended by BEL or ST */
+    ESCAPE_STATE_CONTROL_STRING,  /* ESC P, ESC X, ESC ^ or ESC _, ended by ST */
+    ESCAPE_STATE_COUNT
+} escape_state_t;
+
+/* Macros */
+#define UNUSED(var) ((void)(var))
+#define NEXT_CYCLIC_ELEMENT(array, index, array_size) \
+    (((index) + 1 == (array_size)) ? (array)[0] : (array)[((index) + 1)] )
+#define IS_IN_ESCAPE(state) ((state) > ESCAPE_STATE_LAST)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+
+/* *** Constants *****************************************************/
+#define MAX_FLAG_STRIPES (16)
+#define MAX_ANSII_CODES_PER_STRIPE (5)
+#define MAX_ANSII_CODES_COUNT (MAX_FLAG_STRIPES * MAX_ANSII_CODES_PER_STRIPE)
+#define MAX_FLAG_NAME_LENGTH (64)
+
+#define OUTPUT_BUFFER_SIZE (256 * 1024)
+#define OUTPUT_GROWABLE (-1)
+#define OUTPUT_FIXED (-2)
+#define MAX_ESCAPE_CODE_LENGTH (20) /* "\033[38;2;255;255;255m" and its NUL. */
+#define MAX_CHAR_OUTPUT_LENGTH (32) /* "</span><span class=qc31>&amp;", more than any escape code. */
+#define ANSII_CODES_COUNT (256)
+#define RESET_ESCAPE_CODE "\033[0m"
+#define UTF8_MAX_LENGTH (4)
+#define UTF8_INVALID ((wint_t)-2)
+#define UTF8_REPLACEMENT_CHAR "\xef\xbf\xbd"
+
+#define GRADIENT_BITS (12)
+#define GRADIENT_SIZE (1 << GRADIENT_BITS)
+
+#define HTML_CLASS_BITS (5)
+#define HTML_CLASSES_COUNT (1 << HTML_CLASS_BITS)
+#define HTML_SPAN_END "</span>"
+#define MAX_HTML_STYLE_LENGTH (HTML_CLASSES_COUNT * 24 + 16) /* ".qc31{color:#ffffff}" each, in <style>. */
+#define HTML_START "<pre class=queercat>"   /* Around the whole HTML output of the program. */
+#define HTML_END "</pre>\n"
+
+
+/* *** Types *********************************************************/
+/* Colors. */
+typedef uint32_t hex_color_t;
+typedef unsigned char ansii_code_t;
+typedef struct color_s {
+    uint8_t red;
+    uint8_t green;
+    uint8_t blue;
+} color_t;
+
+/* Color type patterns. */
+typedef struct ansii_pattern_s {
+    unsigned int codes_count;
+    unsigned char ansii_codes[MAX_ANSII_CODES_COUNT];
+} ansii_pattern_t;
+typedef struct color_pattern_s {
+    uint8_t stripes_count;
+    uint32_t stripes_colors[MAX_FLAG_STRIPES];
+    float factor;
+} color_pattern_t;
+
+/* Get color function. */
+typedef void(get_color_f)(const color_pattern_t *color_pattern, float theta, color_t *color);
+
+/* Pattern. */
+typedef struct pattern_s {
+    char name[MAX_FLAG_NAME_LENGTH];
+    ansii_pattern_t ansii_pattern;
+    color_pattern_t color_pattern;
+    get_color_f *get_color;
+} pattern_t;
+
+/* Escape code, formatted once and then only copied out. */
+typedef struct escape_code_s {
+    uint8_t length;
+    char bytes[MAX_ESCAPE_CODE_LENGTH - 1];
+} escape_code_t;
+
+/* Gradient, a ring of colors sampled evenly over a full period of theta, their escape codes
+ * and their nearest ANSI codes. */
+typedef struct gradient_s {
+    color_t colors[GRADIENT_SIZE];
+    escape_code_t escape_codes[GRADIENT_SIZE];
+    ansii_code_t ansii_codes[GRADIENT_SIZE];
+} gradient_t;
+
+/* Flag of a registry, with its gradient when it was compiled ahead. */
+struct queercat_flag_s {
+    pattern_t pattern;
+    const gradient_t *gradient;
+    gradient_t *owned_gradient;
+};
+
+/* Plain ASCII scanner, returns the length of the leading run of printable ASCII. */
+typedef size_t(scan_ascii_f)(const uint8_t *bytes, size_t length);
+
+/* Time spent in a stage of a run, and the bytes it moved. */
+typedef struct stage_stats_s {
+    uint64_t bytes;
+    uint64_t wall_ns;
+    uint64_t cpu_ns;             /* Of the thread running the stage. */
+} stage_stats_t;
+typedef struct stage_clock_s {
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+} stage_clock_t;
+
+/* Output buffer, flushed to fd when full. OUTPUT_GROWABLE buffers grow instead, and
+ * OUTPUT_FIXED ones (the caller's memory) are only fed what queercat_output_bound says fits. */
+typedef struct output_buffer_s {
+    int fd;
+    size_t length;
+    size_t capacity;
+    char *data;
+    stage_stats_t *stats;        /* Writes are timed into it when set. */
+    bool overflow;               /* A fixed buffer was too small, its output was lost. */
+} output_buffer_t;
+
+/* Last color sent to the terminal, used to skip repeated escapes. */
+typedef struct emitter_s {
+    bool valid;
+    color_t color;
+    ansii_code_t code;
+} emitter_t;
+
+/* Colorizing kernels, the block loop specialized for one way of coloring. */
+typedef enum kernel_type_e {
+    KERNEL_TYPE_PLAIN = 0,
+    KERNEL_TYPE_ANSII,
+    KERNEL_TYPE_ANSII_GRADIENT,
+    KERNEL_TYPE_24_BIT,
+    KERNEL_TYPE_24_BIT_THRESHOLD,
+    KERNEL_TYPE_HTML,
+    KERNEL_TYPE_LAYOUT,           /* Records the cells to color instead of coloring them. */
+    KERNEL_TYPE_COUNT
+} kernel_type_t;
+typedef struct colorizer_s colorizer_t;
+typedef size_t(colorize_block_f)(colorizer_t *colorizer, const uint8_t *block, size_t length, bool final);
+typedef struct kernel_s {
+    const char *name;
+    colorize_block_f *colorize_block;
+} kernel_t;
+
+/* Grapheme cluster state, between two chars. A zeroed state breaks before the next char. */
+typedef struct grapheme_state_s {
+    uint8_t previous_class;
+    uint8_t width;                /* Columns of the cluster so far. */
+    bool emoji;                   /* An emoji, then only extenders and joiners since. */
+    bool odd_regional_indicators;
+} grapheme_state_t;
+
+/* Grapheme cluster the kernels would color, and where it is on screen. */
+typedef struct layout_cell_s {
+    uint32_t phase;
+    uint32_t line;
+    uint32_t column;
+    uint32_t width;
+    size_t offset;                /* Of its bytes in the layout text. */
+    size_t length;
+} layout_cell_t;
+
+/* Input laid out by the layout kernel: its text, escapes included but without our colors,
+ * and the cells to color in it. */
+typedef struct layout_s {
+    output_buffer_t text;
+    layout_cell_t *cells;
+    size_t cells_count;
+    size_t cells_capacity;
+    uint32_t column;
+    bool cell_open;               /* The last cell may still grow. */
+} layout_t;
+
+/* Colorizer state, shared by all inputs. */
+struct colorizer_s {
+    const kernel_t *kernel;
+    const gradient_t *gradient;
+    const ansii_code_t *ansii_codes;
+    unsigned int ansii_codes_count;
+    const escape_code_t *ansii_escape_codes;
+    const escape_code_t *html_span_codes; /* "<span class=qcN>" of each class. */
+    bool html_style_pending;      /* The stylesheet goes before the first HTML output. */
+    color_type_t color_type;
+    bool print_colors;
+    double threshold_squared;
+    emitter_t emitter;
+    scan_ascii_f *scan_ascii;
+
+    /* Position in the pattern as a fixed-point phase: a full period is 2^32, so it wraps around
+     * for free. It moves by a step per column and per line, whatever the length of the input. */
+    uint32_t column_step;
+    uint32_t line_step;
+    uint32_t line_phase;          /* Phase at the start of the line. */
+    uint32_t phase;
+    unsigned int ansii_base;      /* ANSI code index at phase 0. */
+    uint64_t line_index;
+    grapheme_state_t grapheme;
+    escape_state_t escape_state;
+    size_t escape_length; /* Output bytes of the escape sequence still open. */
+    output_buffer_t *output;
+    queercat_stats_t stats;
+    layout_t *layout;             /* Only for the layout kernel. */
+
+    /* First escape sent since the color was last unknown, for chunks colored ahead of time. */
+    bool first_escape_pending;
+    size_t first_escape_offset;
+    size_t first_escape_length;
+    emitter_t first_emitter;
+};
+
+/* Stream, a colorizer writing into the caller's buffers. */
+struct queercat_stream_s {
+    colorizer_t colorizer;
+    output_buffer_t output;
+    gradient_t gradient;
+    escape_code_t ansii_escape_codes[ANSII_CODES_COUNT];
+    escape_code_t html_span_codes[HTML_CLASSES_COUNT];
+    uint8_t carry[UTF8_MAX_LENGTH];
+    size_t carry_length;
+};
+
+
+/* *** Functions Declarations ****************************************/
+/* Output */
+void write_all(int fd, const void *bytes, size_t length);
+void output_write(output_buffer_t *output, const void *bytes, size_t length);
+void output_flush(output_buffer_t *output);
+void output_reserve(output_buffer_t *output, size_t length);
+void output_append(output_buffer_t *output, const void *bytes, size_t length);
+
+/* Stage timing */
+void stage_begin(stage_clock_t *clock);
+void stage_end(stage_stats_t *stats, const stage_clock_t *clock, uint64_t bytes);
+uint64_t clock_ns(clockid_t clock_id);
+
+/* Colors handling */
+get_color_f get_color_rainbow;
+get_color_f get_color_stripes;
+const pattern_t *get_pattern(flag_type_t flag_type);
+void build_gradient(const pattern_t *pattern, gradient_t *gradient);
+void build_ansii_escape_codes(escape_code_t escape_codes[ANSII_CODES_COUNT]);
+ansii_code_t quantize_color(const color_t *color);
+float color_distance_squared(const color_t *color1, const color_t *color2);
+scan_ascii_f *select_scan_ascii(void);
+size_t colorize_block(colorizer_t *colorizer, const uint8_t *block, size_t length, bool final);
+void write_html_style(colorizer_t *colorizer);
+
+/* Layout */
+void layout_text(colorizer_t *colorizer, layout_t *layout, const uint8_t *text, size_t length);
+void layout_free(layout_t *layout);
+const escape_code_t *color_at_phase(const colorizer_t *colorizer, uint32_t phase, uint32_t *key);
+
+#endif /* QUEERCAT_INTERNAL_H */
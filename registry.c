@@ -0,0 +1,605 @@
+#define _GNU_SOURCE
+
+/* *** Includes ******************************************************/
+#include <stdbool.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "queercat_internal.h"
+
+
+/* *** Constants *****************************************************/
+#define REGISTRY_TABLE_MIN_SIZE (32)
+#define MAX_CONFIG_SIZE (1024 * 1024)
+#define DEFAULT_STRIPES_FACTOR (4.0f)
+#define CONFIG_SEPARATORS " \t,"
+
+#define FLAG_CACHE_MAGIC "QCFLAGS"
+#define FLAG_CACHE_VERSION (2)
+
+
+/* *** Types *********************************************************/
+/* Mapped cache file, the flags loaded from it point into it. */
+typedef struct mapping_s {
+    void *data;
+    size_t length;
+} mapping_t;
+
+/* Registry, the flags in the order they were added and a hash table of them by name. */
+struct queercat_registry_s {
+    queercat_flag_t **flags;
+    size_t flags_count;
+    size_t flags_capacity;
+    queercat_flag_t **table;      /* Open addressing, linear probing. */
+    size_t table_size;
+    mapping_t *mappings;
+    size_t mappings_count;
+};
+
+/* Cache file: a header keyed by the config, then the compiled flags. */
+typedef struct flag_cache_header_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    int64_t config_mtime_sec;
+    int64_t config_mtime_nsec;
+    uint64_t config_size;
+    uint64_t config_hash;
+    uint64_t flags_count;
+} flag_cache_header_t;
+
+typedef struct flag_cache_entry_s {
+    char name[MAX_FLAG_NAME_LENGTH];
+    ansii_pattern_t ansii_pattern;
+    color_pattern_t color_pattern;
+    gradient_t gradient;
+} flag_cache_entry_t;
+
+
+/* *** Functions Declarations ****************************************/
+/* Table */
+static uint64_t hash_bytes(const void *bytes, size_t length);
+static queercat_flag_t **find_slot(const queercat_registry_t *registry, const char *name);
+static bool add_flag(queercat_registry_t *registry, queercat_flag_t *flag);
+static void free_flag(queercat_flag_t *flag);
+static void clear_registry(queercat_registry_t *registry);
+
+/* Config */
+static char *trim(char *text);
+static bool parse_stripes(color_pattern_t *color_pattern, char *value);
+static bool parse_ansii_codes(ansii_pattern_t *ansii_pattern, char *value);
+static bool parse_config(queercat_registry_t *parsed, char *text, int *error_line);
+
+/* Cache */
+static bool is_cache_valid(const flag_cache_header_t *header, size_t length, const struct stat *config_stat, uint64_t config_hash);
+static int load_cache(queercat_registry_t *registry, const char *cache_path, const struct stat *config_stat, uint64_t config_hash);
+static void save_cache(const queercat_registry_t *parsed, const char *cache_path, const struct stat *config_stat, uint64_t config_hash);
+
+
+/* *** Globals *******************************************************/
+/* Names of the built-in flags in --help, and the names they are registered by. */
+static const char *const flag_aliases[][2] = {
+    { "trans", "transgender" },
+    { "NB", "nonbinary" },
+    { "pan", "pansexual" },
+    { "bi", "bisexual" },
+    { "genderfluid", "gender_fluid" },
+};
+
+
+/* *** Functions *****************************************************/
+static uint64_t hash_bytes(const void *bytes, size_t length)
+{
+    /* FNV-1a. */
+    uint64_t hash = 0xcbf29ce484222325;
+
+    for (size_t i = 0; i < length; i++) {
+        hash ^= ((const uint8_t *)bytes)[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+static queercat_flag_t **find_slot(const queercat_registry_t *registry, const char *name)
+{
+    size_t mask = registry->table_size - 1;
+    size_t index = hash_bytes(name, strlen(name)) & mask;
+
+    /* The table is never full, the probe ends on the flag or on a free slot. */
+    while (registry->table[index] && strcmp(registry->table[index]->pattern.name, name))
+        index = (index + 1) & mask;
+    return &registry->table[index];
+}
+
+static bool add_flag(queercat_registry_t *registry, queercat_flag_t *flag)
+{
+    queercat_flag_t **slot;
+
+    /* Keep the table at most half full. */
+    if ((registry->flags_count + 1) * 2 > registry->table_size) {
+        size_t table_size = registry->table_size ? registry->table_size * 2 : REGISTRY_TABLE_MIN_SIZE;
+        queercat_flag_t **table = calloc(table_size, sizeof(*table));
+        queercat_flag_t **old_table = registry->table;
+
+        if (!table)
+            return false;
+        registry->table = table;
+        registry->table_size = table_size;
+        for (size_t i = 0; i < registry->flags_count; i++)
+            *find_slot(registry, registry->flags[i]->pattern.name) = registry->flags[i];
+        free(old_table);
+    }
+
+    if (registry->flags_count == registry->flags_capacity) {
+        size_t capacity = registry->flags_capacity ? registry->flags_capacity * 2 : REGISTRY_TABLE_MIN_SIZE;
+        queercat_flag_t **flags = realloc(registry->flags, capacity * sizeof(*flags));
+
+        if (!flags)
+            return false;
+        registry->flags = flags;
+        registry->flags_capacity = capacity;
+    }
+
+    /* A flag with the same name is replaced in place. */
+    slot = find_slot(registry, flag->pattern.name);
+    if (*slot) {
+        for (size_t i = 0; i < registry->flags_count; i++) {
+            if (registry->flags[i] == *slot)
+                registry->flags[i] = flag;
+        }
+        free_flag(*slot);
+    } else {
+        registry->flags[registry->flags_count++] = flag;
+    }
+    *slot = flag;
+
+    return true;
+}
+
+static void free_flag(queercat_flag_t *flag)
+{
+    free(flag->owned_gradient);
+    free(flag);
+}
+
+static void clear_registry(queercat_registry_t *registry)
+{
+    for (size_t i = 0; i < registry->flags_count; i++)
+        free_flag(registry->flags[i]);
+    for (size_t i = 0; i < registry->mappings_count; i++)
+        munmap(registry->mappings[i].data, registry->mappings[i].length);
+    free(registry->flags);
+    free(registry->table);
+    free(registry->mappings);
+    *registry = (queercat_registry_t){ 0 };
+}
+
+queercat_registry_t *queercat_registry_new(void)
+{
+    queercat_registry_t *registry = calloc(1, sizeof(*registry));
+
+    if (!registry)
+        return NULL;
+
+    /* The built-in flags, in the order of their numbers. */
+    for (flag_type_t flag_type = FLAG_TYPE_RAINBOW; flag_type < FLAG_TYPE_END; flag_type++) {
+        queercat_flag_t *flag = calloc(1, sizeof(*flag));
+
+        if (flag)
+            flag->pattern = *get_pattern(flag_type);
+        if (!flag || !add_flag(registry, flag)) {
+            free(flag);
+            queercat_registry_free(registry);
+            return NULL;
+        }
+    }
+
+    return registry;
+}
+
+void queercat_registry_free(queercat_registry_t *registry)
+{
+    if (!registry)
+        return;
+    clear_registry(registry);
+    free(registry);
+}
+
+int queercat_registry_compile(queercat_registry_t *registry)
+{
+    for (size_t i = 0; i < registry->flags_count; i++) {
+        queercat_flag_t *flag = registry->flags[i];
+
+        if (flag->gradient)
+            continue;
+        flag->owned_gradient = malloc(sizeof(gradient_t));
+        if (!flag->owned_gradient)
+            return -1;
+        build_gradient(&flag->pattern, flag->owned_gradient);
+        flag->gradient = flag->owned_gradient;
+    }
+    return 0;
+}
+
+const queercat_flag_t *queercat_registry_find(const queercat_registry_t *registry, const char *name)
+{
+    if (!registry->table_size)
+        return NULL;
+
+    /* A flag of the config goes first, then the short names of the built-in flags. */
+    if (*find_slot(registry, name))
+        return *find_slot(registry, name);
+    for (size_t i = 0; i < sizeof(flag_aliases) / sizeof(flag_aliases[0]); i++) {
+        if (!strcmp(name, flag_aliases[i][0]))
+            return *find_slot(registry, flag_aliases[i][1]);
+    }
+    return NULL;
+}
+
+static char *trim(char *text)
+{
+    char *end = text + strlen(text);
+
+    while (isspace((unsigned char)*text))
+        text++;
+    while (end > text && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+    return text;
+}
+
+static bool parse_stripes(color_pattern_t *color_pattern, char *value)
+{
+    char *saveptr;
+
+    /* "#rrggbb" colors, the "#" is optional. */
+    color_pattern->stripes_count = 0;
+    for (char *token = strtok_r(value, CONFIG_SEPARATORS, &saveptr); token; token = strtok_r(NULL, CONFIG_SEPARATORS, &saveptr)) {
+        char *endptr;
+
+        if (*token == '#')
+            token++;
+        if (strlen(token) != 6 || color_pattern->stripes_count == MAX_FLAG_STRIPES)
+            return false;
+        color_pattern->stripes_colors[color_pattern->stripes_count++] = strtoul(token, &endptr, 16);
+        if (*endptr)
+            return false;
+    }
+
+    return color_pattern->stripes_count > 0;
+}
+
+static bool parse_ansii_codes(ansii_pattern_t *ansii_pattern, char *value)
+{
+    char *saveptr;
+
+    ansii_pattern->codes_count = 0;
+    for (char *token = strtok_r(value, CONFIG_SEPARATORS, &saveptr); token; token = strtok_r(NULL, CONFIG_SEPARATORS, &saveptr)) {
+        char *endptr;
+        long code = strtol(token, &endptr, 10);
+
+        if (*endptr || code < 0 || code >= ANSII_CODES_COUNT || ansii_pattern->codes_count == MAX_ANSII_CODES_COUNT)
+            return false;
+        ansii_pattern->ansii_codes[ansii_pattern->codes_count++] = code;
+    }
+
+    return ansii_pattern->codes_count > 0;
+}
+
+static bool parse_config(queercat_registry_t *parsed, char *text, int *error_line)
+{
+    queercat_flag_t *flag = NULL;
+    int flag_line = 0;
+    int line_number = 0;
+    char *next_line;
+
+    for (char *line = text; line; line = next_line) {
+        char *separator;
+
+        next_line = strchr(line, '\n');
+        if (next_line)
+            *next_line++ = '\0';
+        line = trim(line);
+        line_number++;
+
+        /* Skip blank lines and comments. */
+        if (!*line || *line == '#' || *line == ';')
+            continue;
+
+        if (*line == '[') {
+            char *name = line + 1;
+            char *end = strchr(name, ']');
+
+            /* A new flag, the last one must be complete. */
+            if (flag && !flag->pattern.color_pattern.stripes_count) {
+                *error_line = flag_line;
+                return false;
+            }
+            if (!end || end[1]) {
+                *error_line = line_number;
+                return false;
+            }
+            *end = '\0';
+            name = trim(name);
+            if (!*name || strlen(name) >= MAX_FLAG_NAME_LENGTH || strpbrk(name, " \t") || isdigit((unsigned char)*name)) {
+                *error_line = line_number;
+                return false;
+            }
+
+            flag = calloc(1, sizeof(*flag));
+            if (!flag)
+                return false;
+            strcpy(flag->pattern.name, name);
+            flag->pattern.color_pattern.factor = DEFAULT_STRIPES_FACTOR;
+            flag->pattern.get_color = get_color_stripes;
+            if (!add_flag(parsed, flag)) {
+                free(flag);
+                return false;
+            }
+            flag_line = line_number;
+            continue;
+        }
+
+        /* "key = value", inside a flag. */
+        separator = strchr(line, '=');
+        if (!flag || !separator) {
+            *error_line = line_number;
+            return false;
+        }
+        *separator = '\0';
+        char *key = trim(line);
+        char *value = trim(separator + 1);
+        bool valid;
+
+        if (!strcmp(key, "stripes")) {
+            valid = parse_stripes(&flag->pattern.color_pattern, value);
+        } else if (!strcmp(key, "ansi")) {
+            valid = parse_ansii_codes(&flag->pattern.ansii_pattern, value);
+        } else if (!strcmp(key, "factor")) {
+            char *endptr;
+            flag->pattern.color_pattern.factor = strtof(value, &endptr);
+            valid = *value && !*endptr && flag->pattern.color_pattern.factor > 0;
+        } else {
+            valid = false;
+        }
+        if (!valid) {
+            *error_line = line_number;
+            return false;
+        }
+    }
+
+    if (flag && !flag->pattern.color_pattern.stripes_count) {
+        *error_line = flag_line;
+        return false;
+    }
+
+    return true;
+}
+
+static bool is_cache_valid(const flag_cache_header_t *header, size_t length, const struct stat *config_stat, uint64_t config_hash)
+{
+    return length >= sizeof(*header)
+           && !memcmp(header->magic, FLAG_CACHE_MAGIC, sizeof(header->magic))
+           && header->version == FLAG_CACHE_VERSION
+           && header->entry_size == sizeof(flag_cache_entry_t)
+           && header->config_mtime_sec == config_stat->st_mtim.tv_sec
+           && header->config_mtime_nsec == config_stat->st_mtim.tv_nsec
+           && header->config_size == (uint64_t)config_stat->st_size
+           && header->config_hash == config_hash
+           && header->flags_count == (length - sizeof(*header)) / sizeof(flag_cache_entry_t)
+           && (length - sizeof(*header)) % sizeof(flag_cache_entry_t) == 0;
+}
+
+static int load_cache(queercat_registry_t *registry, const char *cache_path, const struct stat *config_stat, uint64_t config_hash)
+{
+    queercat_registry_t loaded = { 0 };
+    const flag_cache_header_t *header;
+    const flag_cache_entry_t *entries;
+    mapping_t *mappings;
+    struct stat cache_stat;
+    void *data;
+    int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &cache_stat) || cache_stat.st_size < (off_t)sizeof(*header)) {
+        close(fd);
+        return -1;
+    }
+    data = mmap(NULL, cache_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return -1;
+
+    /* The compiled flags are only good for the config they were compiled from. */
+    header = data;
+    entries = (const flag_cache_entry_t *)(header + 1);
+    if (!is_cache_valid(header, cache_stat.st_size, config_stat, config_hash))
+        goto fail;
+
+    for (uint64_t i = 0; i < header->flags_count; i++) {
+        const flag_cache_entry_t *entry = &entries[i];
+        queercat_flag_t *flag;
+
+        if (!memchr(entry->name, '\0', sizeof(entry->name))
+                || !entry->color_pattern.stripes_count || entry->color_pattern.stripes_count > MAX_FLAG_STRIPES
+                || entry->ansii_pattern.codes_count > MAX_ANSII_CODES_COUNT)
+            goto fail;
+
+        flag = calloc(1, sizeof(*flag));
+        if (!flag)
+            goto fail;
+        memcpy(flag->pattern.name, entry->name, sizeof(entry->name));
+        flag->pattern.ansii_pattern = entry->ansii_pattern;
+        flag->pattern.color_pattern = entry->color_pattern;
+        flag->pattern.get_color = get_color_stripes;
+        flag->gradient = &entry->gradient;
+        if (!add_flag(&loaded, flag)) {
+            free(flag);
+            goto fail;
+        }
+    }
+
+    mappings = realloc(registry->mappings, (registry->mappings_count + 1) * sizeof(*mappings));
+    if (!mappings)
+        goto fail;
+    registry->mappings = mappings;
+    registry->mappings[registry->mappings_count++] = (mapping_t){ data, cache_stat.st_size };
+
+    for (size_t i = 0; i < loaded.flags_count; i++) {
+        if (!add_flag(registry, loaded.flags[i]))
+            free_flag(loaded.flags[i]);
+    }
+    free(loaded.flags);
+    free(loaded.table);
+    return 0;
+
+fail:
+    clear_registry(&loaded);
+    munmap(data, cache_stat.st_size);
+    return -1;
+}
+
+static void save_cache(const queercat_registry_t *parsed, const char *cache_path, const struct stat *config_stat, uint64_t config_hash)
+{
+    flag_cache_header_t header = {
+        .magic = FLAG_CACHE_MAGIC,
+        .version = FLAG_CACHE_VERSION,
+        .entry_size = sizeof(flag_cache_entry_t),
+        .config_mtime_sec = config_stat->st_mtim.tv_sec,
+        .config_mtime_nsec = config_stat->st_mtim.tv_nsec,
+        .config_size = config_stat->st_size,
+        .config_hash = config_hash,
+        .flags_count = parsed->flags_count
+    };
+    size_t path_length = strlen(cache_path);
+    char *temporary_path = malloc(path_length + sizeof(".XXXXXX"));
+    flag_cache_entry_t *entry = calloc(1, sizeof(*entry));
+    FILE *file = NULL;
+    bool written;
+    int fd = -1;
+
+    /* The cache only saves time, failing to write it is not an error. Write it aside and rename
+     * it over the old one, so readers never see half of it. */
+    if (temporary_path && entry) {
+        memcpy(temporary_path, cache_path, path_length);
+        strcpy(temporary_path + path_length, ".XXXXXX");
+        fd = mkstemp(temporary_path);
+    }
+    if (fd >= 0)
+        file = fdopen(fd, "wb");
+    if (!file) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(temporary_path);
+        }
+        free(temporary_path);
+        free(entry);
+        return;
+    }
+
+    written = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (size_t i = 0; written && i < parsed->flags_count; i++) {
+        const queercat_flag_t *flag = parsed->flags[i];
+
+        memcpy(entry->name, flag->pattern.name, sizeof(entry->name));
+        entry->ansii_pattern = flag->pattern.ansii_pattern;
+        entry->color_pattern = flag->pattern.color_pattern;
+        entry->gradient = *flag->gradient;
+        written = fwrite(entry, sizeof(*entry), 1, file) == 1;
+    }
+    written = !fclose(file) && written;
+
+    if (!written || rename(temporary_path, cache_path))
+        unlink(temporary_path);
+    free(temporary_path);
+    free(entry);
+}
+
+int queercat_registry_load(queercat_registry_t *registry, const char *config_path, const char *cache_path, int *error_line)
+{
+    queercat_registry_t parsed = { 0 };
+    struct stat config_stat;
+    uint64_t config_hash;
+    size_t length = 0;
+    ssize_t result;
+    char *text;
+    int fd = open(config_path, O_RDONLY | O_CLOEXEC);
+    int line = 0;
+
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &config_stat)) {
+        close(fd);
+        return -1;
+    }
+    if (config_stat.st_size > MAX_CONFIG_SIZE) {
+        close(fd);
+        errno = EFBIG;
+        return -1;
+    }
+
+    /* Read it whole, its hash keys the cache. */
+    text = malloc(config_stat.st_size + 1);
+    if (!text) {
+        close(fd);
+        return -1;
+    }
+    while ((result = read(fd, text + length, config_stat.st_size - length)) > 0 || (result < 0 && errno == EINTR))
+        length += (result > 0) ? result : 0;
+    close(fd);
+    if (result < 0) {
+        free(text);
+        return -1;
+    }
+    text[length] = '\0';
+    config_hash = hash_bytes(text, length);
+
+    if (cache_path && !load_cache(registry, cache_path, &config_stat, config_hash)) {
+        free(text);
+        return 0;
+    }
+
+    if (!parse_config(&parsed, text, &line)) {
+        free(text);
+        clear_registry(&parsed);
+        if (line) {
+            if (error_line)
+                *error_line = line;
+            errno = EINVAL;
+        }
+        return -1;
+    }
+    free(text);
+
+    /* Compile the flags now, for the cache and for the streams. */
+    for (size_t i = 0; i < parsed.flags_count; i++) {
+        queercat_flag_t *flag = parsed.flags[i];
+
+        flag->owned_gradient = malloc(sizeof(gradient_t));
+        if (!flag->owned_gradient) {
+            clear_registry(&parsed);
+            return -1;
+        }
+        build_gradient(&flag->pattern, flag->owned_gradient);
+        flag->gradient = flag->owned_gradient;
+    }
+
+    if (cache_path)
+        save_cache(&parsed, cache_path, &config_stat, config_hash);
+
+    for (size_t i = 0; i < parsed.flags_count; i++) {
+        if (!add_flag(registry, parsed.flags[i]))
+            free_flag(parsed.flags[i]);
+    }
+    free(parsed.flags);
+    free(parsed.table);
+
+    return 0;
+}
@@ -0,0 +1,561 @@
+#define _GNU_SOURCE
+
+/* *** Includes ******************************************************/
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "queercat_internal.h"
+#include "server.h"
+
+
+/* *** Constants *****************************************************/
+#define SERVER_BLOCK_SIZE (16 * 1024)
+#define SERVER_OUTPUT_SIZE (64 * 1024)  /* Colored in as many passes as the input needs. */
+#define FRAME_HEADER_SIZE (4)           /* Big-endian length of the output that follows. */
+#define SOCKET_UMASK (0077)             /* The socket is for its owner only, mode 0600. */
+#define MAX_HEADER_LENGTH (1024)
+#define MAX_EVENTS (64)
+#define LISTEN_BACKLOG (128)
+#define HEADER_SEPARATORS " \t"
+#define REPLY_ACCEPTED "OK\n"
+#define REPLY_REFUSED "ERR\n"
+
+
+/* *** Types *********************************************************/
+/* A client stream. It starts with a header line of options, answered by REPLY_ACCEPTED or
+ * REPLY_REFUSED, then the input until the client shuts down its side. The output goes back in
+ * frames, each a FRAME_HEADER_SIZE length and that much output, and an empty frame once the stream
+ * ended well. Input is only read once the last block is colored and sent. */
+typedef struct connection_s {
+    int fd;
+    queercat_stream_t *stream;    /* NULL until the header is in, and the buffers with it. */
+    char header[MAX_HEADER_LENGTH];
+    size_t header_length;
+    uint8_t *input;
+    size_t input_length;
+    size_t input_offset;
+    char *output;
+    size_t output_length;
+    size_t output_offset;
+    bool input_done;
+    bool stream_done;
+} connection_t;
+
+
+/* *** Functions Declarations ****************************************/
+/* Server */
+static int listen_socket(const char *socket_path);
+static bool parse_header(char *header, const queercat_registry_t *registry, queercat_options_t *options);
+static void close_connection(int epoll_fd, connection_t *connection);
+static size_t put_frame(char *frame, size_t length);
+static bool send_output(int epoll_fd, connection_t *connection);
+static bool receive_input(int epoll_fd, connection_t *connection, const queercat_registry_t *registry);
+
+/* Client */
+static int connect_socket(const char *socket_path);
+static int open_input(const char *filename);
+
+/* *** Functions *****************************************************/
+static int listen_socket(const char *socket_path)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    mode_t old_umask;
+    int result;
+    int fd;
+
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    /* A socket nobody answers on is left over from a server that died, take its place. */
+    fd = connect_socket(socket_path);
+    if (fd >= 0) {
+        close(fd);
+        errno = EADDRINUSE;
+        return -1;
+    }
+    unlink(socket_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    /* Created with the mode of the umask, set it for the bind alone. */
+    old_umask = umask(SOCKET_UMASK);
+    result = bind(fd, (struct sockaddr *)&address, sizeof(address));
+    umask(old_umask);
+    if (result || listen(fd, LISTEN_BACKLOG)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool parse_header(char *header, const queercat_registry_t *registry, queercat_options_t *options)
+{
+    char *saveptr;
+
+    /* "key=value" pairs, anything left out keeps its default. */
+    queercat_options_init(options);
+    for (char *token = strtok_r(header, HEADER_SEPARATORS, &saveptr); token; token = strtok_r(NULL, HEADER_SEPARATORS, &saveptr)) {
+        char *value = strchr(token, '=');
+        char *endptr;
+
+        if (!value)
+            return false;
+        *value++ = '\0';
+
+        if (!strcmp(token, "flag")) {
+            long number = strtol(value, &endptr, 10);
+            const char *name = value;
+
+            /* Built-in flags by number, any flag of the registry by name. */
+            if (!*endptr && endptr != value) {
+                if (number < FLAG_TYPE_RAINBOW || number >= FLAG_TYPE_END)
+                    return false;
+                name = get_pattern((flag_type_t)number)->name;
+            }
+            options->flag = queercat_registry_find(registry, name);
+            if (!options->flag)
+                return false;
+            continue;
+        }
+
+        if (!strcmp(token, "color"))
+            options->color_type = (color_type_t)strtol(value, &endptr, 10);
+        else if (!strcmp(token, "colors"))
+            options->print_colors = strtol(value, &endptr, 10) != 0;
+        else if (!strcmp(token, "freq_h"))
+            options->freq_h = strtod(value, &endptr);
+        else if (!strcmp(token, "freq_v"))
+            options->freq_v = strtod(value, &endptr);
+        else if (!strcmp(token, "offx"))
+            options->offx = strtod(value, &endptr);
+        else if (!strcmp(token, "rand"))
+            options->rand_offset = strtol(value, &endptr, 10);
+        else if (!strcmp(token, "threshold"))
+            options->threshold = strtod(value, &endptr);
+        else
+            return false;
+        if (*endptr || endptr == value)
+            return false;
+    }
+
+    return true;
+}
+
+static void close_connection(int epoll_fd, connection_t *connection)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+    close(connection->fd);
+    queercat_stream_free(connection->stream);
+    free(connection->input);
+    free(connection->output);
+    free(connection);
+}
+
+static size_t put_frame(char *frame, size_t length)
+{
+    for (int i = 0; i < FRAME_HEADER_SIZE; i++)
+        frame[i] = (char)(length >> (8 * (FRAME_HEADER_SIZE - 1 - i)));
+    return FRAME_HEADER_SIZE + length;
+}
+
+static bool send_output(int epoll_fd, connection_t *connection)
+{
+    struct epoll_event event = { .data.ptr = connection };
+
+    for (;;) {
+        while (connection->output_offset < connection->output_length) {
+            ssize_t result = send(connection->fd, connection->output + connection->output_offset,
+                                  connection->output_length - connection->output_offset, MSG_NOSIGNAL);
+            if (result < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN)
+                    return false;
+
+                /* The client is slow, stop reading its input until it took the output. */
+                event.events = EPOLLOUT;
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+                return true;
+            }
+            connection->output_offset += result;
+        }
+        connection->output_length = 0;
+        connection->output_offset = 0;
+
+        /* All sent: color what fits of the rest of the block, or end a finished stream. */
+        if (connection->input_offset < connection->input_length) {
+            size_t consumed;
+            ssize_t result = queercat_stream_feed(connection->stream, connection->input + connection->input_offset,
+                                                  connection->input_length - connection->input_offset,
+                                                  connection->output + FRAME_HEADER_SIZE,
+                                                  SERVER_OUTPUT_SIZE - FRAME_HEADER_SIZE, &consumed);
+            if (result < 0)
+                return false;
+            connection->output_length = result ? put_frame(connection->output, result) : 0;
+            connection->input_offset += consumed;
+        } else if (connection->input_done && !connection->stream_done) {
+            ssize_t result = queercat_stream_flush(connection->stream, connection->output + FRAME_HEADER_SIZE,
+                                                   SERVER_OUTPUT_SIZE - 2 * FRAME_HEADER_SIZE);
+            if (result < 0)
+                return false;
+
+            /* Only a stream colored to its end gets the empty frame, the client tells it from a
+             * server that went away. */
+            connection->output_length = result ? put_frame(connection->output, result) : 0;
+            connection->output_length += put_frame(connection->output + connection->output_length, 0);
+            connection->stream_done = true;
+        } else {
+            break;
+        }
+    }
+
+    /* Done with a finished stream, or back to reading. */
+    if (connection->input_done)
+        return false;
+    event.events = EPOLLIN;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+    return true;
+}
+
+static bool receive_input(int epoll_fd, connection_t *connection, const queercat_registry_t *registry)
+{
+    uint8_t block[SERVER_BLOCK_SIZE];
+    const uint8_t *input = block;
+    ssize_t length;
+
+    length = recv(connection->fd, block, sizeof(block), 0);
+    if (length < 0)
+        return errno == EINTR || errno == EAGAIN;
+
+    if (length == 0) {
+        /* The client is done sending, end its stream. */
+        if (!connection->stream)
+            return false;
+        connection->input_done = true;
+        return send_output(epoll_fd, connection);
+    }
+
+    if (!connection->stream) {
+        char *newline = memchr(block, '\n', length);
+        size_t taken = newline ? (size_t)(newline - (char *)block) + 1 : (size_t)length;
+        queercat_options_t options;
+
+        if (connection->header_length + taken > sizeof(connection->header))
+            return false;
+        memcpy(connection->header + connection->header_length, block, taken);
+        connection->header_length += taken;
+        if (!newline)
+            return true;
+
+        /* Header complete, the stream starts right after it. */
+        connection->header[connection->header_length - 1] = '\0';
+        connection->stream = parse_header(connection->header, registry, &options) ? queercat_stream_new(&options) : NULL;
+        if (!connection->stream) {
+            send(connection->fd, REPLY_REFUSED, strlen(REPLY_REFUSED), MSG_NOSIGNAL | MSG_DONTWAIT);
+            return false;
+        }
+        input += taken;
+        length -= taken;
+
+        /* Only a stream that started needs buffers. The reply goes out ahead of its output. */
+        connection->input = malloc(SERVER_BLOCK_SIZE);
+        connection->output = malloc(SERVER_OUTPUT_SIZE);
+        if (!connection->input || !connection->output)
+            return false;
+        memcpy(connection->output, REPLY_ACCEPTED, strlen(REPLY_ACCEPTED));
+        connection->output_length = strlen(REPLY_ACCEPTED);
+    }
+
+    memcpy(connection->input, input, length);
+    connection->input_length = length;
+    connection->input_offset = 0;
+    return send_output(epoll_fd, connection);
+}
+
+int run_server(const char *socket_path, const queercat_registry_t *registry)
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event listen_event = { .events = EPOLLIN };
+    int listen_fd = listen_socket(socket_path);
+    int epoll_fd;
+
+    if (listen_fd < 0) {
+        fwprintf(stderr, L"Cannot listen on \"%s\": %s\n", socket_path, strerror(errno));
+        return 2;
+    }
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_event)) {
+        fwprintf(stderr, L"Cannot create the event loop: %s\n", strerror(errno));
+        return 2;
+    }
+
+    /* The listening socket is the only event without a connection. */
+    for (;;) {
+        int count = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            fwprintf(stderr, L"Error waiting for events: %s\n", strerror(errno));
+            return 2;
+        }
+
+        for (int i = 0; i < count; i++) {
+            connection_t *connection = events[i].data.ptr;
+
+            if (!connection) {
+                int fd;
+
+                while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    struct epoll_event event = { .events = EPOLLIN };
+
+                    connection = calloc(1, sizeof(*connection));
+                    event.data.ptr = connection;
+                    if (!connection || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+                        free(connection);
+                        close(fd);
+                        continue;
+                    }
+                    connection->fd = fd;
+                }
+                continue;
+            }
+
+            bool keep;
+            if (events[i].events & EPOLLOUT)
+                keep = send_output(epoll_fd, connection);
+            else if (events[i].events & EPOLLIN)
+                keep = receive_input(epoll_fd, connection, registry);
+            else
+                keep = false;
+            if (!keep)
+                close_connection(epoll_fd, connection);
+        }
+    }
+}
+
+static int connect_socket(const char *socket_path)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address))) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+static int open_input(const char *filename)
+{
+    int fd;
+
+    if (!strcmp(filename, "-"))
+        return STDIN_FILENO;
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        fwprintf(stderr, L"Cannot open input file \"%s\": %s\n", filename, strerror(errno));
+    return fd;
+}
+
+int run_client(const char *socket_path, const queercat_options_t *options, const char *flag_name,
+               char **filenames, size_t filenames_count)
+{
+    char header[MAX_HEADER_LENGTH];
+    uint8_t input[SERVER_BLOCK_SIZE];
+    uint8_t output[SERVER_BLOCK_SIZE];
+    size_t input_length;
+    size_t input_offset = 0;
+    bool input_open = true;
+    size_t input_index = 0;
+    int input_fd;
+    char reply[sizeof(REPLY_REFUSED) + 1] = { 0 };
+    size_t reply_length = 0;
+    bool answered = false;
+    uint8_t frame_header[FRAME_HEADER_SIZE];
+    size_t frame_header_length = 0;
+    size_t frame_remaining = 0;
+    bool html = options->color_type == COLOR_TYPE_HTML;
+    int fd;
+    int length;
+
+    /* The files go out one after the other, as a single stream. */
+    for (size_t i = 0; i < filenames_count; i++) {
+        if (!strcmp(filenames[i], "--help")) {
+            fwprintf(stderr, L"Cannot send \"%s\" to the server, only files\n", filenames[i]);
+            return 1;
+        }
+    }
+    input_fd = open_input(filenames[0]);
+    if (input_fd < 0)
+        return 2;
+
+    fd = connect_socket(socket_path);
+    if (fd < 0) {
+        fwprintf(stderr, L"Cannot connect to \"%s\": %s\n", socket_path, strerror(errno));
+        return 2;
+    }
+
+    /* The header goes out like input, ahead of it. */
+    if (flag_name)
+        length = snprintf(header, sizeof(header), "flag=%s", flag_name);
+    else
+        length = snprintf(header, sizeof(header), "flag=%d", options->flag_type);
+    length += snprintf(header + length, sizeof(header) - length,
+                       " color=%d colors=%d freq_h=%.17g freq_v=%.17g offx=%.17g rand=%d threshold=%.17g\n",
+                       options->color_type, options->print_colors, options->freq_h, options->freq_v,
+                       options->offx, options->rand_offset, options->threshold);
+    if (length >= (int)sizeof(header)) {
+        fwprintf(stderr, L"Invalid flag: %s\n", flag_name);
+        return 1;
+    }
+    memcpy(input, header, length);
+    input_length = length;
+
+    /* Send input only while the socket takes it, and always take the output, so neither
+     * side waits on the other. */
+    for (;;) {
+        struct pollfd fds[2] = {
+            { .fd = fd, .events = POLLIN | ((input_offset < input_length) ? POLLOUT : 0) },
+            { .fd = (input_open && input_offset == input_length) ? input_fd : -1, .events = POLLIN }
+        };
+        ssize_t result;
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            uint8_t *data = output;
+
+            result = recv(fd, output, sizeof(output), 0);
+            if (result < 0) {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+
+            /* The output starts once the server accepted the header. HTML output is wrapped
+             * in its <pre> element, as without the server. */
+            while (result > 0 && !answered && reply_length < sizeof(reply) - 1) {
+                reply[reply_length++] = *data++;
+                result--;
+                answered = reply[reply_length - 1] == '\n';
+                if (answered && html && !strcmp(reply, REPLY_ACCEPTED))
+                    write_all(STDOUT_FILENO, HTML_START, strlen(HTML_START));
+            }
+            if (answered ? strcmp(reply, REPLY_ACCEPTED) != 0 : (reply_length == sizeof(reply) - 1 || data == output)) {
+                fwprintf(stderr, L"The server refused the stream, check the flag and options\n");
+                close(fd);
+                return 1;
+            }
+
+            /* Without the empty frame the stream did not end, the output is cut short. */
+            if (data == output && result == 0) {
+                fwprintf(stderr, L"The server closed the stream before its end\n");
+                close(fd);
+                return 2;
+            }
+
+            /* The output comes in frames, each after its length. */
+            while (result > 0) {
+                size_t taken;
+
+                if (!frame_remaining) {
+                    frame_header[frame_header_length++] = *data++;
+                    result--;
+                    if (frame_header_length < FRAME_HEADER_SIZE)
+                        continue;
+                    frame_header_length = 0;
+                    for (int i = 0; i < FRAME_HEADER_SIZE; i++)
+                        frame_remaining = (frame_remaining << 8) | frame_header[i];
+
+                    /* The empty frame ends the stream. */
+                    if (!frame_remaining) {
+                        if (html)
+                            write_all(STDOUT_FILENO, HTML_END, strlen(HTML_END));
+                        close(fd);
+                        return 0;
+                    }
+                    continue;
+                }
+
+                taken = ((size_t)result < frame_remaining) ? (size_t)result : frame_remaining;
+                write_all(STDOUT_FILENO, data, taken);
+                data += taken;
+                result -= taken;
+                frame_remaining -= taken;
+            }
+        }
+
+        if (fds[0].revents & POLLOUT) {
+            result = send(fd, input + input_offset, input_length - input_offset, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (result < 0 && errno != EINTR && errno != EAGAIN) {
+                /* The server stopped reading, what it has to say comes with the end of its output. */
+                input_open = false;
+                input_offset = input_length;
+            }
+            if (result > 0)
+                input_offset += result;
+        }
+
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            result = read(input_fd, input, sizeof(input));
+            if (result < 0 && errno != EINTR) {
+                fwprintf(stderr, L"Error reading input file \"%s\": %s\n", filenames[input_index], strerror(errno));
+                close(fd);
+                return 2;
+            }
+            if (result == 0) {
+                if (input_fd > STDIN_FILENO)
+                    close(input_fd);
+
+                /* On to the next file. The server ends the stream once it sees the end of ours. */
+                if (++input_index < filenames_count) {
+                    input_fd = open_input(filenames[input_index]);
+                    if (input_fd < 0) {
+                        close(fd);
+                        return 2;
+                    }
+                } else {
+                    input_open = false;
+                    shutdown(fd, SHUT_WR);
+                }
+            } else if (result > 0) {
+                input_length = result;
+                input_offset = 0;
+            }
+        }
+    }
+
+    fwprintf(stderr, L"Error talking to \"%s\": %s\n", socket_path, strerror(errno));
+    close(fd);
+    return 2;
+}
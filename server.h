@@ -0,0 +1,19 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+/* *** Includes ******************************************************/
+#include "queercat.h"
+
+
+/* *** Functions Declarations ****************************************/
+/* Serve colorizing streams on a Unix socket of mode 0600 until killed, returns 2 if it cannot
+ * listen. */
+int run_server(const char *socket_path, const queercat_registry_t *registry);
+
+/* Have the server at socket_path colorize the files ("-" for stdin) to stdout, as a single
+ * stream. Returns the exit status, 2 when the server closes before the end of the stream. The
+ * flag is looked up by the server when flag_name is set. */
+int run_client(const char *socket_path, const queercat_options_t *options, const char *flag_name,
+               char **filenames, size_t filenames_count);
+
+#endif /* SERVER_H */
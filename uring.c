@@ -0,0 +1,378 @@
+#define _GNU_SOURCE
+
+/* *** Includes ******************************************************/
+#include <stdbool.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <wchar.h>
+#include "queercat_internal.h"
+#include "uring.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+
+/* *** Constants *****************************************************/
+#define PIPELINE_BLOCK_SIZE (64 * 1024)
+#define PIPELINE_BUFFERS (2)
+#define RING_ENTRIES (4)
+#define MAX_REAPED (2 * RING_ENTRIES)  /* The completion queue is twice the submission queue. */
+
+/* What a completion is for. */
+#define REQUEST_READ (1)
+#define REQUEST_WRITE (2)
+
+
+#ifdef HAVE_IO_URING
+/* *** Types *********************************************************/
+/* At most one read and one write are in flight: while block n is colored, block n + 1 is read
+ * into the other input buffer and the output of block n - 1 is written from the other output
+ * buffer. */
+struct uring_pipeline_s {
+    int ring_fd;
+
+    /* Submission queue, shared with the kernel. */
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    /* Completion queue, shared with the kernel. */
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* Completions taken out of the queue to make room for a submission, not handled yet. */
+    struct io_uring_cqe reaped[MAX_REAPED];
+    size_t reaped_count;
+
+    uint8_t *input[PIPELINE_BUFFERS];
+    char *output[PIPELINE_BUFFERS];
+    size_t output_capacity;
+
+    /* Requests in flight. */
+    int in_fd;
+    int out_fd;
+    bool reading;
+    uint8_t *read_buffer;
+    ssize_t read_result;
+    bool writing;
+    const char *write_data;
+    size_t write_length;
+    stage_stats_t *write_stats;
+};
+
+
+/* *** Functions Declarations ****************************************/
+/* Ring */
+static void *map_ring(int ring_fd, size_t size, off_t offset);
+static void submit(uring_pipeline_t *pipeline, uint8_t opcode, int fd, void *buffer, size_t length, uint64_t user_data);
+static void reap(uring_pipeline_t *pipeline);
+static void complete(uring_pipeline_t *pipeline, const struct io_uring_cqe *cqe);
+static void wait_for(uring_pipeline_t *pipeline, const bool *busy, stage_stats_t *stats);
+
+/* Pipeline */
+static void start_read(uring_pipeline_t *pipeline, uint8_t *buffer);
+static void start_write(uring_pipeline_t *pipeline, const char *data, size_t length);
+
+
+/* *** Functions *****************************************************/
+static void *map_ring(int ring_fd, size_t size, off_t offset)
+{
+    void *ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+    return (ring == MAP_FAILED) ? NULL : ring;
+}
+
+uring_pipeline_t *uring_pipeline_new(void)
+{
+    struct io_uring_params params = { 0 };
+    uring_pipeline_t *pipeline = calloc(1, sizeof(uring_pipeline_t));
+    int error;
+
+    if (!pipeline)
+        return NULL;
+
+    /* Fails with ENOSYS on old kernels, and EPERM where it is disabled or filtered out. */
+    pipeline->ring_fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if (pipeline->ring_fd < 0) {
+        free(pipeline);
+        return NULL;
+    }
+
+    /* Reads and writes at the current position of the file came with IORING_OP_READ and WRITE. */
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        errno = ENOSYS;
+        goto error;
+    }
+
+    pipeline->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    pipeline->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    pipeline->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    pipeline->sq_ring = map_ring(pipeline->ring_fd, pipeline->sq_ring_size, IORING_OFF_SQ_RING);
+    pipeline->cq_ring = map_ring(pipeline->ring_fd, pipeline->cq_ring_size, IORING_OFF_CQ_RING);
+    pipeline->sqes = map_ring(pipeline->ring_fd, pipeline->sqes_size, IORING_OFF_SQES);
+    if (!pipeline->sq_ring || !pipeline->cq_ring || !pipeline->sqes)
+        goto error;
+
+    pipeline->sq_tail = (unsigned *)((char *)pipeline->sq_ring + params.sq_off.tail);
+    pipeline->sq_mask = (unsigned *)((char *)pipeline->sq_ring + params.sq_off.ring_mask);
+    pipeline->cq_head = (unsigned *)((char *)pipeline->cq_ring + params.cq_off.head);
+    pipeline->cq_tail = (unsigned *)((char *)pipeline->cq_ring + params.cq_off.tail);
+    pipeline->cq_mask = (unsigned *)((char *)pipeline->cq_ring + params.cq_off.ring_mask);
+    pipeline->cqes = (struct io_uring_cqe *)((char *)pipeline->cq_ring + params.cq_off.cqes);
+
+    /* Submission entries are used in order, the indirection array never changes. */
+    unsigned *sq_array = (unsigned *)((char *)pipeline->sq_ring + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++)
+        sq_array[i] = i;
+
+    pipeline->output_capacity = queercat_output_bound(PIPELINE_BLOCK_SIZE);
+    for (int i = 0; i < PIPELINE_BUFFERS; i++) {
+        pipeline->input[i] = malloc(PIPELINE_BLOCK_SIZE);
+        pipeline->output[i] = malloc(pipeline->output_capacity);
+        if (!pipeline->input[i] || !pipeline->output[i])
+            goto error;
+    }
+
+    return pipeline;
+
+error:
+    error = errno;
+    uring_pipeline_free(pipeline);
+    errno = error;
+    return NULL;
+}
+
+void uring_pipeline_free(uring_pipeline_t *pipeline)
+{
+    if (!pipeline)
+        return;
+
+    for (int i = 0; i < PIPELINE_BUFFERS; i++) {
+        free(pipeline->input[i]);
+        free(pipeline->output[i]);
+    }
+    if (pipeline->sqes)
+        munmap(pipeline->sqes, pipeline->sqes_size);
+    if (pipeline->cq_ring)
+        munmap(pipeline->cq_ring, pipeline->cq_ring_size);
+    if (pipeline->sq_ring)
+        munmap(pipeline->sq_ring, pipeline->sq_ring_size);
+    close(pipeline->ring_fd);
+    free(pipeline);
+}
+
+static void submit(uring_pipeline_t *pipeline, uint8_t opcode, int fd, void *buffer, size_t length, uint64_t user_data)
+{
+    unsigned tail = *pipeline->sq_tail;
+    struct io_uring_sqe *sqe = &pipeline->sqes[tail & *pipeline->sq_mask];
+    unsigned flags = 0;
+
+    /* An offset of -1 reads or writes at the current position, pipes and files alike. */
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->off = (uint64_t)-1;
+    sqe->addr = (uintptr_t)buffer;
+    sqe->len = length;
+    sqe->user_data = user_data;
+    __atomic_store_n(pipeline->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    while (syscall(__NR_io_uring_enter, pipeline->ring_fd, 1, 0, flags, NULL, 0) < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            fwprintf(stderr, L"Error submitting to io_uring: %s\n", strerror(errno));
+            exit(2);
+        }
+
+        /* The completions have no room left: take them out, and have the kernel move in those
+         * it kept aside, before trying again. */
+        if (errno == EBUSY) {
+            reap(pipeline);
+            flags = IORING_ENTER_GETEVENTS;
+        }
+    }
+}
+
+static void reap(uring_pipeline_t *pipeline)
+{
+    unsigned head = *pipeline->cq_head;
+
+    /* Handled by wait_for, before what is still in the queue. */
+    while (pipeline->reaped_count < MAX_REAPED && head != __atomic_load_n(pipeline->cq_tail, __ATOMIC_ACQUIRE))
+        pipeline->reaped[pipeline->reaped_count++] = pipeline->cqes[head++ & *pipeline->cq_mask];
+    __atomic_store_n(pipeline->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void complete(uring_pipeline_t *pipeline, const struct io_uring_cqe *cqe)
+{
+    if (cqe->user_data == REQUEST_READ) {
+        /* A nonblocking input has nothing yet, wait for it as read would have. */
+        if (cqe->res == -EAGAIN || cqe->res == -EINTR) {
+            struct pollfd input = { .fd = pipeline->in_fd, .events = POLLIN };
+            if (cqe->res == -EAGAIN)
+                poll(&input, 1, -1);
+            submit(pipeline, IORING_OP_READ, pipeline->in_fd, pipeline->read_buffer, PIPELINE_BLOCK_SIZE, REQUEST_READ);
+            return;
+        }
+        pipeline->read_result = cqe->res;
+        pipeline->reading = false;
+        return;
+    }
+
+    if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -EINTR) {
+        fwprintf(stderr, L"Error writing output: %s\n", strerror(-cqe->res));
+        exit(2);
+    }
+    if (cqe->res == -EAGAIN) {
+        struct pollfd output = { .fd = pipeline->out_fd, .events = POLLOUT };
+        poll(&output, 1, -1);
+    } else if (cqe->res > 0) {
+        if (pipeline->write_stats)
+            pipeline->write_stats->bytes += cqe->res;
+        pipeline->write_data += cqe->res;
+        pipeline->write_length -= cqe->res;
+    }
+
+    /* Send the rest of a short write. */
+    if (pipeline->write_length)
+        submit(pipeline, IORING_OP_WRITE, pipeline->out_fd, (void *)pipeline->write_data, pipeline->write_length, REQUEST_WRITE);
+    else
+        pipeline->writing = false;
+}
+
+static void wait_for(uring_pipeline_t *pipeline, const bool *busy, stage_stats_t *stats)
+{
+    stage_clock_t clock;
+
+    if (stats)
+        stage_begin(&clock);
+
+    while (*busy) {
+        unsigned head = *pipeline->cq_head;
+
+        /* Completions reaped by a submission came first. */
+        if (pipeline->reaped_count) {
+            struct io_uring_cqe cqe = pipeline->reaped[0];
+
+            pipeline->reaped_count--;
+            memmove(pipeline->reaped, pipeline->reaped + 1, pipeline->reaped_count * sizeof(cqe));
+            complete(pipeline, &cqe);
+            continue;
+        }
+
+        if (head == __atomic_load_n(pipeline->cq_tail, __ATOMIC_ACQUIRE)) {
+            if (syscall(__NR_io_uring_enter, pipeline->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+                    && errno != EINTR) {
+                fwprintf(stderr, L"Error waiting on io_uring: %s\n", strerror(errno));
+                exit(2);
+            }
+            continue;
+        }
+
+        /* Copy the entry out first, completing it may submit and reuse the slot. */
+        struct io_uring_cqe cqe = pipeline->cqes[head & *pipeline->cq_mask];
+        __atomic_store_n(pipeline->cq_head, head + 1, __ATOMIC_RELEASE);
+        complete(pipeline, &cqe);
+    }
+
+    if (stats)
+        stage_end(stats, &clock, 0);
+}
+
+static void start_read(uring_pipeline_t *pipeline, uint8_t *buffer)
+{
+    pipeline->reading = true;
+    pipeline->read_buffer = buffer;
+    submit(pipeline, IORING_OP_READ, pipeline->in_fd, buffer, PIPELINE_BLOCK_SIZE, REQUEST_READ);
+}
+
+static void start_write(uring_pipeline_t *pipeline, const char *data, size_t length)
+{
+    pipeline->writing = true;
+    pipeline->write_data = data;
+    pipeline->write_length = length;
+    submit(pipeline, IORING_OP_WRITE, pipeline->out_fd, (void *)data, length, REQUEST_WRITE);
+}
+
+int uring_colorize_fd(uring_pipeline_t *pipeline, queercat_stream_t *stream, int fd, int out_fd,
+                      stage_stats_t *read_stats, stage_stats_t *write_stats)
+{
+    int current = 0;
+    int result = 0;
+
+    pipeline->in_fd = fd;
+    pipeline->out_fd = out_fd;
+    pipeline->write_stats = write_stats;
+    start_read(pipeline, pipeline->input[current]);
+
+    for (;;) {
+        ssize_t length;
+        size_t output_length;
+
+        wait_for(pipeline, &pipeline->reading, read_stats);
+        length = pipeline->read_result;
+        if (length <= 0) {
+            if (length < 0) {
+                errno = -length;
+                result = -1;
+            }
+            break;
+        }
+        if (read_stats)
+            read_stats->bytes += length;
+
+        /* Read the next block while this one is colored. */
+        start_read(pipeline, pipeline->input[current ^ 1]);
+        output_length = queercat_stream_feed(stream, pipeline->input[current], length,
+                                             pipeline->output[current], pipeline->output_capacity, NULL);
+
+        /* The other output buffer is free once its write is done. */
+        wait_for(pipeline, &pipeline->writing, write_stats);
+        if (output_length)
+            start_write(pipeline, pipeline->output[current], output_length);
+        current ^= 1;
+    }
+
+    wait_for(pipeline, &pipeline->writing, write_stats);
+    return result;
+}
+
+#else
+uring_pipeline_t *uring_pipeline_new(void)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+void uring_pipeline_free(uring_pipeline_t *pipeline)
+{
+    UNUSED(pipeline);
+}
+
+int uring_colorize_fd(uring_pipeline_t *pipeline, queercat_stream_t *stream, int fd, int out_fd,
+                      stage_stats_t *read_stats, stage_stats_t *write_stats)
+{
+    UNUSED(pipeline);
+    UNUSED(stream);
+    UNUSED(fd);
+    UNUSED(out_fd);
+    UNUSED(read_stats);
+    UNUSED(write_stats);
+    errno = ENOSYS;
+    return -1;
+}
+#endif
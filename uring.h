@@ -0,0 +1,24 @@
+#ifndef URING_H
+#define URING_H
+
+/* *** Includes ******************************************************/
+#include "queercat_internal.h"
+
+
+/* *** Types *********************************************************/
+/* An io_uring and the buffers of a read, color and write pipeline. */
+typedef struct uring_pipeline_s uring_pipeline_t;
+
+
+/* *** Functions Declarations ****************************************/
+/* Returns NULL, with errno set, when io_uring is not available. */
+uring_pipeline_t *uring_pipeline_new(void);
+void uring_pipeline_free(uring_pipeline_t *pipeline);
+
+/* Colorize fd to out_fd, reading the next block and writing the last one while coloring. Returns
+ * -1 with errno set on read errors, the stream still has to be flushed. Waits are timed into the
+ * stats when set. */
+int uring_colorize_fd(uring_pipeline_t *pipeline, queercat_stream_t *stream, int fd, int out_fd,
+                      stage_stats_t *read_stats, stage_stats_t *write_stats);
+
+#endif /* URING_H */